@@ -0,0 +1,387 @@
+//----------------------------------------------------------------------------------------------//
+// FILE: bench.cpp                                                                              //
+// AUTHOR: Ian Murfin - github.com/ianmurfinxyz                                                 //
+//----------------------------------------------------------------------------------------------//
+//
+// Decode benchmarks for every pixel layout the loader supports. Each bitmap is generated in
+// memory with random pixels and decoded with BmpImage::loadFromMemory, so the timings measure
+// only header parsing and pixel extraction, never the disk. Each layout is decoded repeatedly
+// into the same image, so the allocation counts are those of a steady state reload.
+//
+// usage: bench [--min-size N] [--max-size N] [--threads N] [--filter TEXT] [--mips]
+//              [--mips-srgb] [--csv] [--stats]
+//
+// The rle layouts hold runs of random indices, 32 pixels long on average, and are only stored
+// bottom-up. The MB/s of every layout is that of its pixel array's bytes, compressed or not.
+//
+// --mips and --mips-srgb also build a mip pyramid with each decode.
+//
+// --stats prints the total decode stats of every load as json after the results; they are all
+// zero unless bmpimage.cpp is built with BMP_STATS, as by 'make bench_stats'.
+//
+// note: the largest images (16384x16384) need about 2GB of memory at 32bpp; use --max-size to
+// skip them on smaller machines.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+#include "../bmpimage.h"
+
+//------------------------------------------------------------------------------------------------
+//  ALLOCATION COUNTING
+//------------------------------------------------------------------------------------------------
+
+namespace
+{
+std::atomic<uint64_t> numAllocations {0};
+}
+
+void* operator new(size_t size_bytes)
+{
+  ++numAllocations;
+  void* p {std::malloc(size_bytes == 0 ? 1 : size_bytes)};
+  if(p == nullptr)
+    std::abort();
+  return p;
+}
+
+void* operator new[](size_t size_bytes)
+{
+  return operator new(size_bytes);
+}
+
+void* operator new(size_t size_bytes, const std::nothrow_t&) noexcept
+{
+  ++numAllocations;
+  return std::malloc(size_bytes == 0 ? 1 : size_bytes);
+}
+
+void* operator new[](size_t size_bytes, const std::nothrow_t& tag) noexcept
+{
+  return operator new(size_bytes, tag);
+}
+
+void operator delete(void* p) noexcept {std::free(p);}
+void operator delete[](void* p) noexcept {std::free(p);}
+void operator delete(void* p, size_t) noexcept {std::free(p);}
+void operator delete[](void* p, size_t) noexcept {std::free(p);}
+
+namespace
+{
+
+//------------------------------------------------------------------------------------------------
+//  SYNTHETIC BITMAPS
+//------------------------------------------------------------------------------------------------
+
+constexpr uint32_t BI_RGB {0};
+constexpr uint32_t BI_RLE8 {1};
+constexpr uint32_t BI_RLE4 {2};
+constexpr uint32_t BI_BITFIELDS {3};
+
+// the mean length of the runs of rle bitmaps.
+constexpr int MEAN_RUN_PX {32};
+
+struct Layout
+{
+  const char* _name;
+  int _bitsPerPixel;
+  uint32_t _compression;
+  uint32_t _infoHeaderSize_bytes;   // 40 with bitfields appends the rgb masks to the header.
+  uint32_t _masks[4];               // red, green, blue, alpha.
+};
+
+const Layout layouts[] {
+  {"1bpp_indexed",       1,  BI_RGB,       40, {0, 0, 0, 0}},
+  {"2bpp_indexed",       2,  BI_RGB,       40, {0, 0, 0, 0}},
+  {"4bpp_indexed",       4,  BI_RGB,       40, {0, 0, 0, 0}},
+  {"4bpp_rle4",          4,  BI_RLE4,      40, {0, 0, 0, 0}},
+  {"8bpp_indexed",       8,  BI_RGB,       40, {0, 0, 0, 0}},
+  {"8bpp_rle8",          8,  BI_RLE8,      40, {0, 0, 0, 0}},
+  {"16bpp_x1r5g5b5",     16, BI_BITFIELDS, 40, {0x7c00, 0x03e0, 0x001f, 0}},
+  {"16bpp_a1r5g5b5",     16, BI_BITFIELDS, 56, {0x7c00, 0x03e0, 0x001f, 0x8000}},
+  {"16bpp_r5g6b5",       16, BI_BITFIELDS, 40, {0xf800, 0x07e0, 0x001f, 0}},
+  {"16bpp_a4r4g4b4",     16, BI_BITFIELDS, 56, {0x0f00, 0x00f0, 0x000f, 0xf000}},   // generic masks.
+  {"24bpp_r8g8b8",       24, BI_RGB,       40, {0, 0, 0, 0}},
+  {"32bpp_a8r8g8b8",     32, BI_BITFIELDS, 56, {0xff0000, 0x00ff00, 0x0000ff, 0xff000000}},
+  {"32bpp_x8r8g8b8",     32, BI_BITFIELDS, 56, {0xff0000, 0x00ff00, 0x0000ff, 0}},
+  {"32bpp_a2r10g10b10",  32, BI_BITFIELDS, 56, {0x3ff00000, 0x000ffc00, 0x000003ff, 0xc0000000}},
+  {"32bpp_a2b10g10r10",  32, BI_BITFIELDS, 56, {0x000003ff, 0x000ffc00, 0x3ff00000, 0xc0000000}},
+  {"32bpp_r16g16",       32, BI_BITFIELDS, 56, {0x0000ffff, 0xffff0000, 0, 0}},     // wide generic masks.
+};
+
+template<typename T>
+void writeField(uint8_t*& cursor, T value)
+{
+  std::memcpy(cursor, &value, sizeof(T));
+  cursor += sizeof(T);
+}
+
+// fills bytes with a cheap xorshift stream; the decoders' speed does not depend on the values.
+void fillRandom(uint8_t* bytes, size_t size_bytes, uint64_t seed)
+{
+  uint64_t state {seed | 1};
+  size_t i {0};
+  for(; i + 8 <= size_bytes; i += 8){
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    std::memcpy(bytes + i, &state, 8);
+  }
+  for(; i < size_bytes; ++i)
+    bytes[i] = static_cast<uint8_t>(state >> (8 * (i % 8)));
+}
+
+int64_t getRowSize_bytes(const Layout& layout, int width_px)
+{
+  return ((static_cast<int64_t>(width_px) * layout._bitsPerPixel + 31) / 32) * 4;
+}
+
+bool isRle(const Layout& layout)
+{
+  return layout._compression == BI_RLE8 || layout._compression == BI_RLE4;
+}
+
+// the size of the pixel array of a bitmap made by makeBitmap; all the bytes after its offset.
+int64_t getPixelArraySize_bytes(const std::vector<uint8_t>& bitmap)
+{
+  uint32_t pixelOffset_bytes {0};
+  std::memcpy(&pixelOffset_bytes, bitmap.data() + 10, sizeof(pixelOffset_bytes));
+  return static_cast<int64_t>(bitmap.size()) - pixelOffset_bytes;
+}
+
+// encodes rows of runs of random lengths and indices, as an image of flat areas; every run is
+// an encoded run, with no absolute runs or deltas.
+std::vector<uint8_t> makeRleData(const Layout& layout, int width_px, int height_px)
+{
+  std::vector<uint8_t> data {};
+  uint64_t state {0x9e3779b97f4a7c15ull ^ width_px};
+  auto nextRandom = [&state](){
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+  };
+
+  uint32_t indexMask {(1u << layout._bitsPerPixel) - 1};
+  for(int row = 0; row < height_px; ++row){
+    for(int col = 0; col < width_px;){
+      uint64_t bits {nextRandom()};
+      int run_px {std::min(static_cast<int>(1 + (bits % (2 * MEAN_RUN_PX - 1))), width_px - col)};
+      uint8_t index {static_cast<uint8_t>((bits >> 32) & indexMask)};
+      data.push_back(static_cast<uint8_t>(run_px));
+      data.push_back(layout._compression == BI_RLE4 ? static_cast<uint8_t>((index << 4) | index) : index);
+      col += run_px;
+    }
+    data.push_back(0);
+    data.push_back(row + 1 < height_px ? 0 : 1);   // end of line, or of the bitmap.
+  }
+  return data;
+}
+
+// rle bitmaps are always bottom-up, so isTopOrigin is ignored for them.
+std::vector<uint8_t> makeBitmap(const Layout& layout, int width_px, int height_px, bool isTopOrigin)
+{
+  bool isIndexed {layout._bitsPerPixel <= 8};
+  uint32_t numPaletteColors {isIndexed ? (1u << layout._bitsPerPixel) : 0};
+  uint32_t masksSize_bytes {(layout._compression == BI_BITFIELDS && layout._infoHeaderSize_bytes == 40) ? 12u : 0u};
+  uint32_t pixelOffset_bytes {14 + layout._infoHeaderSize_bytes + masksSize_bytes + (numPaletteColors * 4)};
+  std::vector<uint8_t> rleData {isRle(layout) ? makeRleData(layout, width_px, height_px) : std::vector<uint8_t>{}};
+  int64_t imageSize_bytes {isRle(layout) ? static_cast<int64_t>(rleData.size()) : getRowSize_bytes(layout, width_px) * height_px};
+  isTopOrigin = isTopOrigin && !isRle(layout);
+
+  std::vector<uint8_t> bytes(pixelOffset_bytes + imageSize_bytes);
+  uint8_t* cursor {bytes.data()};
+
+  writeField<uint16_t>(cursor, 0x4D42);
+  writeField<uint32_t>(cursor, static_cast<uint32_t>(bytes.size()));
+  writeField<uint16_t>(cursor, 0);
+  writeField<uint16_t>(cursor, 0);
+  writeField<uint32_t>(cursor, pixelOffset_bytes);
+
+  writeField<uint32_t>(cursor, layout._infoHeaderSize_bytes);
+  writeField<int32_t>(cursor, width_px);
+  writeField<int32_t>(cursor, isTopOrigin ? -height_px : height_px);
+  writeField<uint16_t>(cursor, 1);
+  writeField<uint16_t>(cursor, static_cast<uint16_t>(layout._bitsPerPixel));
+  writeField<uint32_t>(cursor, layout._compression);
+  writeField<uint32_t>(cursor, static_cast<uint32_t>(imageSize_bytes));
+  writeField<int32_t>(cursor, 2835);
+  writeField<int32_t>(cursor, 2835);
+  writeField<uint32_t>(cursor, numPaletteColors);
+  writeField<uint32_t>(cursor, 0);
+
+  if(layout._compression == BI_BITFIELDS){
+    writeField<uint32_t>(cursor, layout._masks[0]);
+    writeField<uint32_t>(cursor, layout._masks[1]);
+    writeField<uint32_t>(cursor, layout._masks[2]);
+    if(layout._infoHeaderSize_bytes >= 56)
+      writeField<uint32_t>(cursor, layout._masks[3]);
+  }
+
+  // the palette and the pixel array are both random, bar the runs of rle bitmaps.
+  fillRandom(cursor, bytes.size() - (cursor - bytes.data()), 0x9e3779b97f4a7c15ull ^ width_px);
+  if(isRle(layout))
+    std::memcpy(bytes.data() + pixelOffset_bytes, rleData.data(), rleData.size());
+
+  return bytes;
+}
+
+//------------------------------------------------------------------------------------------------
+//  BENCHMARK
+//------------------------------------------------------------------------------------------------
+
+struct Options
+{
+  int _minSize_px;
+  int _maxSize_px;
+  int _numThreads;
+  std::string _filter;
+  BmpImage::MipFilter _mipFilter;
+  bool _isCsv;
+  bool _isPrintingStats;
+};
+
+struct Result
+{
+  double _bestTime_s;
+  double _numAllocationsPerDecode;
+  int _numDecodes;
+};
+
+constexpr double MIN_BENCH_TIME_S {0.25};
+constexpr int MIN_DECODES {3};
+
+Result benchDecode(const std::vector<uint8_t>& bitmap, const Options& options)
+{
+  using Clock = std::chrono::steady_clock;
+
+  Result result {1e30, 0.0, 0};
+  uint64_t totalAllocations {0};
+  double totalTime_s {0.0};
+
+  // the image is reused, as by a program reloading its textures, so the untimed first decode
+  // makes the allocations and the rest measure the steady state.
+  BmpImage image {};
+  image.setParallelDecode(options._numThreads);
+  image.setMipmaps(options._mipFilter);
+  if(image.loadFromMemory(bitmap) != 0){
+    std::fprintf(stderr, "decode failed\n");
+    std::exit(EXIT_FAILURE);
+  }
+
+  while(result._numDecodes < MIN_DECODES || totalTime_s < MIN_BENCH_TIME_S){
+    uint64_t allocationsBefore {numAllocations.load()};
+    Clock::time_point start {Clock::now()};
+    int error {image.loadFromMemory(bitmap)};
+    Clock::time_point end {Clock::now()};
+    totalAllocations += numAllocations.load() - allocationsBefore;
+
+    if(error != 0){
+      std::fprintf(stderr, "decode failed\n");
+      std::exit(EXIT_FAILURE);
+    }
+
+    double time_s {std::chrono::duration<double>(end - start).count()};
+    result._bestTime_s = std::min(result._bestTime_s, time_s);
+    totalTime_s += time_s;
+    ++result._numDecodes;
+  }
+
+  result._numAllocationsPerDecode = static_cast<double>(totalAllocations) / result._numDecodes;
+  return result;
+}
+
+int parseOptions(int argc, char** argv, Options& options)
+{
+  options = Options{16, 16384, 1, "", BmpImage::MIP_NONE, false, false};
+  for(int i = 1; i < argc; ++i){
+    std::string arg {argv[i]};
+    bool hasValue {i + 1 < argc};
+    if(arg == "--min-size" && hasValue)
+      options._minSize_px = std::atoi(argv[++i]);
+    else if(arg == "--max-size" && hasValue)
+      options._maxSize_px = std::atoi(argv[++i]);
+    else if(arg == "--threads" && hasValue)
+      options._numThreads = std::max(std::atoi(argv[++i]), 1);
+    else if(arg == "--filter" && hasValue)
+      options._filter = argv[++i];
+    else if(arg == "--mips")
+      options._mipFilter = BmpImage::MIP_BOX;
+    else if(arg == "--mips-srgb")
+      options._mipFilter = BmpImage::MIP_BOX_SRGB;
+    else if(arg == "--csv")
+      options._isCsv = true;
+    else if(arg == "--stats")
+      options._isPrintingStats = true;
+    else
+      return -1;
+  }
+  return 0;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+  Options options {};
+  if(parseOptions(argc, argv, options) != 0){
+    std::fprintf(stderr, "usage: %s [--min-size N] [--max-size N] [--threads N] [--filter TEXT] [--mips] [--mips-srgb] [--csv] [--stats]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if(options._isCsv)
+    std::printf("layout,order,width_px,height_px,best_us,mb_per_s,mpx_per_s,allocs_per_decode\n");
+  else
+    std::printf("%-18s %-9s %13s %10s %10s %10s %8s\n", "layout", "order", "size", "best us", "MB/s", "Mpx/s", "allocs");
+
+  for(int size_px = 16; size_px <= 16384; size_px *= 4){
+    if(size_px < options._minSize_px || size_px > options._maxSize_px)
+      continue;
+
+    for(const Layout& layout : layouts){
+      if(!options._filter.empty() && std::string{layout._name}.find(options._filter) == std::string::npos)
+        continue;
+
+      for(bool isTopOrigin : {false, true}){
+        if(isTopOrigin && isRle(layout))
+          continue;
+
+        Result result {};
+        double pixelArraySize_mb {0.0};
+        {
+          std::vector<uint8_t> bitmap {makeBitmap(layout, size_px, size_px, isTopOrigin)};
+          pixelArraySize_mb = getPixelArraySize_bytes(bitmap) / 1.0e6;
+          result = benchDecode(bitmap, options);
+        }
+
+        double numPixels_m {(static_cast<double>(size_px) * size_px) / 1.0e6};
+        double mbPerS {pixelArraySize_mb / result._bestTime_s};
+        double mpxPerS {numPixels_m / result._bestTime_s};
+        const char* order {isTopOrigin ? "top-down" : "bottom-up"};
+
+        if(options._isCsv){
+          std::printf("%s,%s,%d,%d,%.2f,%.1f,%.1f,%.1f\n", layout._name, order, size_px, size_px,
+                      result._bestTime_s * 1e6, mbPerS, mpxPerS, result._numAllocationsPerDecode);
+        }
+        else{
+          std::string size {std::to_string(size_px) + "x" + std::to_string(size_px)};
+          std::printf("%-18s %-9s %13s %10.1f %10.1f %10.1f %8.1f\n", layout._name, order, size.c_str(),
+                      result._bestTime_s * 1e6, mbPerS, mpxPerS, result._numAllocationsPerDecode);
+        }
+        std::fflush(stdout);
+      }
+    }
+  }
+
+  if(options._isPrintingStats)
+    std::printf("%s\n", BmpImage::formatJson(BmpImage::getTotalDecodeStats()).c_str());
+
+  return EXIT_SUCCESS;
+}
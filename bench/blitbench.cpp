@@ -0,0 +1,259 @@
+//----------------------------------------------------------------------------------------------//
+// FILE: blitbench.cpp                                                                          //
+// AUTHOR: Ian Murfin - github.com/ianmurfinxyz                                                 //
+//----------------------------------------------------------------------------------------------//
+//
+// Blit benchmarks for every blit mode and a range of sprite sizes. Each case blits one sprite
+// to a fixed sequence of positions on an 800x600 target, as the example's screen, with about
+// a third of the blits hanging off an edge, so the timings include the clipping. The naive case
+// is a per pixel copy with a bounds check per pixel, for comparison.
+//
+// The frame cases scale the whole 800x600 screen up by a whole factor into a window with a
+// border around it, as a cpu presentation of the example's screen does each frame.
+//
+// usage: blitbench [--filter TEXT] [--csv]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "../bmpblit.h"
+
+namespace
+{
+
+constexpr int TARGET_WIDTH_PX {800};
+constexpr int TARGET_HEIGHT_PX {600};
+constexpr int NUM_POSITIONS {1024};
+
+constexpr double MIN_BENCH_TIME_S {0.25};
+constexpr int MIN_BATCHES {3};
+
+// how the alpha of the sprite's pixels is chosen; the rgb is always random.
+enum AlphaPattern
+{
+  ALPHA_OPAQUE,
+  ALPHA_RANDOM,
+  ALPHA_CUTOUT   // runs of clear and opaque pixels, as a sprite drawn on a clear background.
+};
+
+struct Case
+{
+  const char* _name;
+  BlitMode _mode;
+  AlphaPattern _pattern;
+  bool _isNaive;
+};
+
+const Case cases[] {
+  {"naive",        BLIT_OPAQUE,    ALPHA_OPAQUE, true},
+  {"opaque",       BLIT_OPAQUE,    ALPHA_OPAQUE, false},
+  {"color_key",    BLIT_COLOR_KEY, ALPHA_CUTOUT, false},
+  {"alpha_cutout", BLIT_ALPHA,     ALPHA_CUTOUT, false},
+  {"alpha_random", BLIT_ALPHA,     ALPHA_RANDOM, false},
+};
+
+const Color4 colorKey {255, 0, 255, 0};
+
+uint32_t nextRandom(uint32_t& state)
+{
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+std::vector<Color4> makeSprite(int width_px, int height_px, AlphaPattern pattern)
+{
+  std::vector<Color4> pixels(static_cast<size_t>(width_px) * height_px);
+  uint32_t state {0x2545f491};
+  bool isClear {false};
+  for(Color4& pixel : pixels){
+    uint32_t bits {nextRandom(state)};
+    uint8_t alpha {255};
+    if(pattern == ALPHA_RANDOM)
+      alpha = static_cast<uint8_t>(bits >> 24);
+    else if(pattern == ALPHA_CUTOUT){
+      if((bits >> 24) < 16)
+        isClear = !isClear;
+      alpha = isClear ? 0 : 255;
+    }
+    pixel = Color4{static_cast<uint8_t>(bits), static_cast<uint8_t>(bits >> 8), static_cast<uint8_t>(bits >> 16), alpha};
+    if(alpha == 0)
+      pixel = colorKey;
+  }
+  return pixels;
+}
+
+// the per pixel loop the example's screen used before blits.
+void blitNaive(const BlitSource& source, const BlitTarget& target, int x, int y)
+{
+  for(int row = 0; row < source._height_px; ++row){
+    for(int col = 0; col < source._width_px; ++col){
+      int targetX {x + col};
+      int targetY {y + row};
+      if(targetX < 0 || targetY < 0 || targetX >= target._width_px || targetY >= target._height_px)
+        continue;
+      target._pixels[targetX + (targetY * target._stride_px)] = source._pixels[col + (row * source._stride_px)];
+    }
+  }
+}
+
+struct Options
+{
+  std::string _filter;
+  bool _isCsv;
+};
+
+struct Result
+{
+  double _bestBatchTime_s;
+  int64_t _numPixelsPerBatch;
+  int _numBatches;
+};
+
+Result benchFrame(int scale)
+{
+  using Clock = std::chrono::steady_clock;
+
+  std::vector<Color4> screen {makeSprite(TARGET_WIDTH_PX, TARGET_HEIGHT_PX, ALPHA_OPAQUE)};
+  int windowWidth_px {(TARGET_WIDTH_PX * scale) + 64};
+  int windowHeight_px {(TARGET_HEIGHT_PX * scale) + 48};
+  std::vector<Color4> window(static_cast<size_t>(windowWidth_px) * windowHeight_px);
+  BlitSource source {screen.data(), TARGET_WIDTH_PX, TARGET_HEIGHT_PX, TARGET_WIDTH_PX};
+  BlitTarget target {window.data(), windowWidth_px, windowHeight_px, windowWidth_px};
+
+  Result result {1e30, static_cast<int64_t>(TARGET_WIDTH_PX * scale) * (TARGET_HEIGHT_PX * scale), 0};
+  blitScaled(source, target, 32, 24, scale);
+
+  double totalTime_s {0.0};
+  while(result._numBatches < MIN_BATCHES || totalTime_s < MIN_BENCH_TIME_S){
+    Clock::time_point start {Clock::now()};
+    blitScaled(source, target, 32, 24, scale);
+    Clock::time_point end {Clock::now()};
+
+    double time_s {std::chrono::duration<double>(end - start).count()};
+    result._bestBatchTime_s = std::min(result._bestBatchTime_s, time_s);
+    totalTime_s += time_s;
+    ++result._numBatches;
+  }
+
+  return result;
+}
+
+Result benchBlit(const Case& benchCase, int size_px)
+{
+  using Clock = std::chrono::steady_clock;
+
+  std::vector<Color4> sprite {makeSprite(size_px, size_px, benchCase._pattern)};
+  std::vector<Color4> screen(static_cast<size_t>(TARGET_WIDTH_PX) * TARGET_HEIGHT_PX);
+  BlitSource source {sprite.data(), size_px, size_px, size_px};
+  BlitTarget target {screen.data(), TARGET_WIDTH_PX, TARGET_HEIGHT_PX, TARGET_WIDTH_PX};
+
+  // positions range up to half a sprite off every edge.
+  std::vector<int> xs(NUM_POSITIONS), ys(NUM_POSITIONS);
+  uint32_t state {0x9e3779b9};
+  for(int i = 0; i < NUM_POSITIONS; ++i){
+    xs[i] = static_cast<int>(nextRandom(state) % (TARGET_WIDTH_PX + size_px)) - (size_px / 2);
+    ys[i] = static_cast<int>(nextRandom(state) % (TARGET_HEIGHT_PX + size_px)) - (size_px / 2);
+  }
+
+  Result result {1e30, 0, 0};
+  for(int i = 0; i < NUM_POSITIONS; ++i){
+    BlitRect area {blit(source, target, xs[i], ys[i], benchCase._mode, colorKey)};
+    result._numPixelsPerBatch += static_cast<int64_t>(area._width_px) * area._height_px;
+  }
+
+  double totalTime_s {0.0};
+  while(result._numBatches < MIN_BATCHES || totalTime_s < MIN_BENCH_TIME_S){
+    Clock::time_point start {Clock::now()};
+    if(benchCase._isNaive){
+      for(int i = 0; i < NUM_POSITIONS; ++i)
+        blitNaive(source, target, xs[i], ys[i]);
+    }
+    else{
+      for(int i = 0; i < NUM_POSITIONS; ++i)
+        blit(source, target, xs[i], ys[i], benchCase._mode, colorKey);
+    }
+    Clock::time_point end {Clock::now()};
+
+    double time_s {std::chrono::duration<double>(end - start).count()};
+    result._bestBatchTime_s = std::min(result._bestBatchTime_s, time_s);
+    totalTime_s += time_s;
+    ++result._numBatches;
+  }
+
+  return result;
+}
+
+int parseOptions(int argc, char** argv, Options& options)
+{
+  options = Options{"", false};
+  for(int i = 1; i < argc; ++i){
+    std::string arg {argv[i]};
+    if(arg == "--filter" && i + 1 < argc)
+      options._filter = argv[++i];
+    else if(arg == "--csv")
+      options._isCsv = true;
+    else
+      return -1;
+  }
+  return 0;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+  Options options {};
+  if(parseOptions(argc, argv, options) != 0){
+    std::fprintf(stderr, "usage: %s [--filter TEXT] [--csv]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if(options._isCsv)
+    std::printf("mode,width_px,height_px,ns_per_blit,mpx_per_s\n");
+  else
+    std::printf("%-14s %9s %12s %10s\n", "mode", "size", "ns/blit", "Mpx/s");
+
+  for(int size_px : {8, 16, 32, 64, 128, 256}){
+    for(const Case& benchCase : cases){
+      if(!options._filter.empty() && std::string{benchCase._name}.find(options._filter) == std::string::npos)
+        continue;
+
+      Result result {benchBlit(benchCase, size_px)};
+      double nsPerBlit {(result._bestBatchTime_s * 1e9) / NUM_POSITIONS};
+      double mpxPerS {(result._numPixelsPerBatch / 1.0e6) / result._bestBatchTime_s};
+
+      if(options._isCsv)
+        std::printf("%s,%d,%d,%.1f,%.1f\n", benchCase._name, size_px, size_px, nsPerBlit, mpxPerS);
+      else{
+        std::string size {std::to_string(size_px) + "x" + std::to_string(size_px)};
+        std::printf("%-14s %9s %12.1f %10.1f\n", benchCase._name, size.c_str(), nsPerBlit, mpxPerS);
+      }
+      std::fflush(stdout);
+    }
+  }
+
+  for(int scale = 1; scale <= 4; ++scale){
+    std::string name {"frame_x" + std::to_string(scale)};
+    if(!options._filter.empty() && name.find(options._filter) == std::string::npos)
+      continue;
+
+    Result result {benchFrame(scale)};
+    double nsPerBlit {result._bestBatchTime_s * 1e9};
+    double mpxPerS {(result._numPixelsPerBatch / 1.0e6) / result._bestBatchTime_s};
+
+    if(options._isCsv)
+      std::printf("%s,%d,%d,%.1f,%.1f\n", name.c_str(), TARGET_WIDTH_PX, TARGET_HEIGHT_PX, nsPerBlit, mpxPerS);
+    else{
+      std::string size {std::to_string(TARGET_WIDTH_PX) + "x" + std::to_string(TARGET_HEIGHT_PX)};
+      std::printf("%-14s %9s %12.1f %10.1f\n", name.c_str(), size.c_str(), nsPerBlit, mpxPerS);
+    }
+    std::fflush(stdout);
+  }
+
+  return EXIT_SUCCESS;
+}
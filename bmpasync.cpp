@@ -0,0 +1,546 @@
+//----------------------------------------------------------------------------------------------//
+// FILE: bmpasync.cpp                                                                           //
+// AUTHOR: Ian Murfin - github.com/ianmurfinxyz                                                 //
+//----------------------------------------------------------------------------------------------//
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include "bmpasync.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+  #define BMP_HAS_IO_URING
+  #include <cerrno>
+  #include <fcntl.h>
+  #include <linux/io_uring.h>
+  #include <sys/eventfd.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <sys/syscall.h>
+  #include <unistd.h>
+#endif
+
+namespace
+{
+
+constexpr unsigned RING_ENTRIES {64};
+constexpr int MAX_READS_IN_FLIGHT {RING_ENTRIES - 1};   // leaves an entry for the wake read.
+constexpr size_t MAX_READ_BYTES {1 << 30};
+constexpr uint64_t WAKE_TAG {0};
+
+BmpAsyncLoader::Result makeError(BmpBatchLoader::Error error)
+{
+  return BmpAsyncLoader::Result{error, 0, 0, {}};
+}
+
+BmpAsyncLoader::Result decodeBytes(const std::vector<uint8_t>& bytes)
+{
+  BmpImage::Info info {};
+  if(BmpImage::probeMemory(bytes.data(), bytes.size(), info) != 0)
+    return makeError(BmpBatchLoader::ERROR_HEADER);
+
+  BmpAsyncLoader::Result result {BmpBatchLoader::ERROR_NONE, info._width_px, info._height_px, {}};
+  result._pixels.resize(static_cast<size_t>(info._width_px) * info._height_px);
+
+  BmpImage::OutputBuffer output {
+    result._pixels.data(),
+    result._pixels.size() * sizeof(Color4),
+    info._width_px * static_cast<int>(sizeof(Color4)),
+    BmpImage::OUTPUT_RGBA8
+  };
+  BmpImage image {};
+  if(image.loadFromMemoryInto(bytes.data(), bytes.size(), output) != 0)
+    return makeError(BmpBatchLoader::ERROR_DECODE);
+
+  return result;
+}
+
+} // namespace
+
+struct BmpAsyncLoader::Request
+{
+  std::string _filename;
+  Callback _onLoaded;
+  int _fd;
+  std::vector<uint8_t> _bytes;
+  size_t _numRead_bytes;
+  BmpBatchLoader::Error _error;
+};
+
+#ifdef BMP_HAS_IO_URING
+
+// A minimal io_uring of a single submitter, driven through the raw system calls.
+class BmpAsyncLoader::IoRing
+{
+public:
+  IoRing() = default;
+  ~IoRing();
+  IoRing(const IoRing&) = delete;
+  IoRing& operator=(const IoRing&) = delete;
+
+  int initialize(unsigned numEntries);
+
+  // returns nullptr if the submission queue is full.
+  io_uring_sqe* getSqe();
+
+  // submits all queued entries then blocks until at least minComplete completions are ready.
+  int submitAndWait(unsigned minComplete);
+
+  bool popCqe(io_uring_cqe& cqe);
+
+  // takes back the queued entries the kernel has not consumed, appending their user data.
+  void takeBackSqes(std::vector<uint64_t>& userData);
+
+private:
+  int _fd {-1};
+  void* _sqRing {nullptr};
+  size_t _sqRingSize_bytes {0};
+  void* _cqRing {nullptr};
+  size_t _cqRingSize_bytes {0};
+  io_uring_sqe* _sqes {nullptr};
+  size_t _sqesSize_bytes {0};
+  unsigned* _sqHead {nullptr};
+  unsigned* _sqTail {nullptr};
+  unsigned* _sqArray {nullptr};
+  unsigned _sqMask {0};
+  unsigned _sqEntries {0};
+  unsigned _sqLocalTail {0};
+  unsigned* _cqHead {nullptr};
+  unsigned* _cqTail {nullptr};
+  io_uring_cqe* _cqes {nullptr};
+  unsigned _cqMask {0};
+};
+
+BmpAsyncLoader::IoRing::~IoRing()
+{
+  if(_sqes != nullptr)
+    munmap(_sqes, _sqesSize_bytes);
+  if(_cqRing != nullptr && _cqRing != _sqRing)
+    munmap(_cqRing, _cqRingSize_bytes);
+  if(_sqRing != nullptr)
+    munmap(_sqRing, _sqRingSize_bytes);
+  if(_fd >= 0)
+    close(_fd);
+}
+
+int BmpAsyncLoader::IoRing::initialize(unsigned numEntries)
+{
+  io_uring_params params {};
+  _fd = static_cast<int>(syscall(__NR_io_uring_setup, numEntries, &params));
+  if(_fd < 0)
+    return -1;
+
+  // IORING_OP_READ arrived in the same kernel version (5.6) as this feature flag.
+  if(!(params.features & IORING_FEAT_RW_CUR_POS))
+    return -1;
+
+  _sqRingSize_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  _cqRingSize_bytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+  // newer kernels map both rings with a single mapping.
+  bool isSingleMap {(params.features & IORING_FEAT_SINGLE_MMAP) != 0};
+  if(isSingleMap)
+    _sqRingSize_bytes = _cqRingSize_bytes = std::max(_sqRingSize_bytes, _cqRingSize_bytes);
+
+  void* sqRing {mmap(nullptr, _sqRingSize_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING)};
+  if(sqRing == MAP_FAILED)
+    return -1;
+  _sqRing = sqRing;
+
+  if(isSingleMap){
+    _cqRing = _sqRing;
+  }
+  else{
+    void* cqRing {mmap(nullptr, _cqRingSize_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING)};
+    if(cqRing == MAP_FAILED)
+      return -1;
+    _cqRing = cqRing;
+  }
+
+  _sqesSize_bytes = params.sq_entries * sizeof(io_uring_sqe);
+  void* sqes {mmap(nullptr, _sqesSize_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES)};
+  if(sqes == MAP_FAILED)
+    return -1;
+  _sqes = static_cast<io_uring_sqe*>(sqes);
+
+  uint8_t* sq {static_cast<uint8_t*>(_sqRing)};
+  _sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  _sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  _sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  _sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  _sqEntries = params.sq_entries;
+  _sqLocalTail = *_sqTail;
+
+  uint8_t* cq {static_cast<uint8_t*>(_cqRing)};
+  _cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  _cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  _cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+  _cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+
+  return 0;
+}
+
+io_uring_sqe* BmpAsyncLoader::IoRing::getSqe()
+{
+  if(_sqLocalTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries)
+    return nullptr;
+
+  unsigned index {_sqLocalTail & _sqMask};
+  _sqArray[index] = index;
+  ++_sqLocalTail;
+
+  io_uring_sqe* sqe {&_sqes[index]};
+  std::memset(sqe, 0, sizeof(io_uring_sqe));
+  return sqe;
+}
+
+int BmpAsyncLoader::IoRing::submitAndWait(unsigned minComplete)
+{
+  __atomic_store_n(_sqTail, _sqLocalTail, __ATOMIC_RELEASE);
+  while(true){
+    // the kernel advances the head past every entry it has consumed, even if interrupted.
+    unsigned numToSubmit {_sqLocalTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE)};
+    unsigned flags {minComplete > 0 ? IORING_ENTER_GETEVENTS : 0u};
+    if(syscall(__NR_io_uring_enter, _fd, numToSubmit, minComplete, flags, nullptr, 0) >= 0)
+      return 0;
+    if(errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      return -1;
+  }
+}
+
+bool BmpAsyncLoader::IoRing::popCqe(io_uring_cqe& cqe)
+{
+  unsigned head {*_cqHead};
+  if(head == __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE))
+    return false;
+
+  cqe = _cqes[head & _cqMask];
+  __atomic_store_n(_cqHead, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+// the kernel only consumes entries during io_uring_enter, so with no submitter polling the
+// ring the unconsumed entries cannot be taken while this runs.
+void BmpAsyncLoader::IoRing::takeBackSqes(std::vector<uint64_t>& userData)
+{
+  unsigned head {__atomic_load_n(_sqHead, __ATOMIC_ACQUIRE)};
+  for(unsigned i = head; i != _sqLocalTail; ++i)
+    userData.push_back(_sqes[_sqArray[i & _sqMask]].user_data);
+  _sqLocalTail = head;
+  __atomic_store_n(_sqTail, head, __ATOMIC_RELEASE);
+}
+
+#else
+
+class BmpAsyncLoader::IoRing {};
+
+#endif
+
+BmpAsyncLoader::BmpAsyncLoader(int numThreads) :
+  _pool{numThreads},
+  _ring{nullptr},
+  _ioThread{},
+  _mutex{},
+  _requests{},
+  _isStopping{false},
+  _isIoFailed{false},
+  _wakeFd{-1},
+  _wakeCount{0},
+  _inFlight{}
+{
+#ifdef BMP_HAS_IO_URING
+  // io_uring may be missing from the kernel or blocked by a seccomp policy.
+  _ring = std::make_unique<IoRing>();
+  if(_ring->initialize(RING_ENTRIES) != 0){
+    _ring.reset();
+    return;
+  }
+
+  _wakeFd = eventfd(0, EFD_CLOEXEC);
+  if(_wakeFd < 0){
+    _ring.reset();
+    return;
+  }
+
+  _ioThread = std::thread{&BmpAsyncLoader::runIo, this};
+#endif
+}
+
+BmpAsyncLoader::~BmpAsyncLoader()
+{
+  if(_ioThread.joinable()){
+    {
+      std::lock_guard<std::mutex> lock {_mutex};
+      _isStopping = true;
+    }
+    wakeIo();
+    _ioThread.join();
+  }
+
+#ifdef BMP_HAS_IO_URING
+  if(_wakeFd >= 0)
+    close(_wakeFd);
+#endif
+
+  _pool.wait();
+}
+
+std::future<BmpAsyncLoader::Result> BmpAsyncLoader::load(std::string filename)
+{
+  std::shared_ptr<std::promise<Result>> promise {std::make_shared<std::promise<Result>>()};
+  std::future<Result> future {promise->get_future()};
+  load(std::move(filename), [promise](Result&& result){promise->set_value(std::move(result));});
+  return future;
+}
+
+void BmpAsyncLoader::load(std::string filename, Callback onLoaded)
+{
+  std::unique_ptr<Request> request {new Request{std::move(filename), std::move(onLoaded), -1, {}, 0, BmpBatchLoader::ERROR_NONE}};
+
+  if(_ring != nullptr){
+    {
+      std::lock_guard<std::mutex> lock {_mutex};
+      if(!_isIoFailed)
+        _requests.push_back(std::move(request));
+    }
+    if(request == nullptr){
+      wakeIo();
+      return;
+    }
+  }
+
+  readOnPool(std::move(request));
+}
+
+#ifdef BMP_HAS_IO_URING
+
+void BmpAsyncLoader::wakeIo()
+{
+  uint64_t one {1};
+  while(write(_wakeFd, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+// The io thread sleeps in the ring until a read completes or a read of the wake eventfd does,
+// the latter signalling new requests (or shutdown).
+void BmpAsyncLoader::runIo()
+{
+  std::deque<std::unique_ptr<Request>> pending {};
+  bool isWakeArmed {false};
+  bool isStopping {false};
+
+  while(true){
+    {
+      std::lock_guard<std::mutex> lock {_mutex};
+      while(!_requests.empty()){
+        pending.push_back(std::move(_requests.front()));
+        _requests.pop_front();
+      }
+      isStopping = _isStopping;
+    }
+
+    while(!pending.empty() && static_cast<int>(_inFlight.size()) < MAX_READS_IN_FLIGHT){
+      startRead(std::move(pending.front()));
+      pending.pop_front();
+    }
+
+    if(!isWakeArmed && !isStopping){
+      io_uring_sqe* sqe {_ring->getSqe()};
+      if(sqe != nullptr){
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = _wakeFd;
+        sqe->addr = reinterpret_cast<uint64_t>(&_wakeCount);
+        sqe->len = sizeof(_wakeCount);
+        sqe->user_data = WAKE_TAG;
+        isWakeArmed = true;
+      }
+    }
+
+    // once stopping, no more requests can arrive, so the io is done when the reads are.
+    if(isStopping && !isWakeArmed && pending.empty() && _inFlight.empty())
+      return;
+
+    if(_ring->submitAndWait(1) != 0){
+      failIo(pending, isWakeArmed);
+      return;
+    }
+
+    io_uring_cqe cqe {};
+    while(_ring->popCqe(cqe)){
+      if(cqe.user_data == WAKE_TAG)
+        isWakeArmed = false;
+      else
+        continueRead(reinterpret_cast<Request*>(cqe.user_data), cqe.res);
+    }
+  }
+}
+
+void BmpAsyncLoader::startRead(std::unique_ptr<Request> request)
+{
+  request->_fd = open(request->_filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if(request->_fd < 0){
+    request->_error = BmpBatchLoader::ERROR_OPEN;
+    decode(std::move(request));
+    return;
+  }
+
+  struct stat status {};
+  if(fstat(request->_fd, &status) != 0){
+    request->_error = BmpBatchLoader::ERROR_OPEN;
+    decode(std::move(request));
+    return;
+  }
+
+  request->_bytes.resize(static_cast<size_t>(status.st_size));
+  if(request->_bytes.empty()){
+    decode(std::move(request));
+    return;
+  }
+
+  _inFlight.push_back(request.get());
+  submitRead(request.release());
+}
+
+void BmpAsyncLoader::continueRead(Request* request, int result)
+{
+  if(result == -EINTR || result == -EAGAIN){
+    submitRead(request);
+    return;
+  }
+
+  if(result < 0){
+    request->_error = BmpBatchLoader::ERROR_OPEN;
+  }
+  else if(result == 0){
+    // the file shrank since it was opened; decode what there is.
+    request->_bytes.resize(request->_numRead_bytes);
+  }
+  else{
+    request->_numRead_bytes += static_cast<size_t>(result);
+    if(request->_numRead_bytes < request->_bytes.size()){
+      submitRead(request);
+      return;
+    }
+  }
+
+  _inFlight.erase(std::find(_inFlight.begin(), _inFlight.end(), request));
+  decode(std::unique_ptr<Request>{request});
+}
+
+void BmpAsyncLoader::submitRead(Request* request)
+{
+  io_uring_sqe* sqe {_ring->getSqe()};
+  if(sqe == nullptr){
+    request->_error = BmpBatchLoader::ERROR_OPEN;
+    _inFlight.erase(std::find(_inFlight.begin(), _inFlight.end(), request));
+    decode(std::unique_ptr<Request>{request});
+    return;
+  }
+
+  size_t remaining_bytes {request->_bytes.size() - request->_numRead_bytes};
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = request->_fd;
+  sqe->addr = reinterpret_cast<uint64_t>(request->_bytes.data() + request->_numRead_bytes);
+  sqe->len = static_cast<uint32_t>(std::min(remaining_bytes, MAX_READ_BYTES));
+  sqe->off = request->_numRead_bytes;
+  sqe->user_data = reinterpret_cast<uint64_t>(request);
+}
+
+// The ring can no longer be entered, so no more reads are submitted. The reads the kernel has
+// already taken still write into their buffers, so their requests are kept until the reads
+// complete; each file is then read again on the pool, as are the requests yet to start and any
+// made later.
+void BmpAsyncLoader::failIo(std::deque<std::unique_ptr<Request>>& pending, bool isWakeArmed)
+{
+  {
+    std::lock_guard<std::mutex> lock {_mutex};
+    _isIoFailed = true;
+    while(!_requests.empty()){
+      pending.push_back(std::move(_requests.front()));
+      _requests.pop_front();
+    }
+  }
+
+  std::vector<uint64_t> untaken {};
+  _ring->takeBackSqes(untaken);
+  for(uint64_t tag : untaken){
+    if(tag == WAKE_TAG)
+      isWakeArmed = false;
+    else{
+      Request* request {reinterpret_cast<Request*>(tag)};
+      _inFlight.erase(std::find(_inFlight.begin(), _inFlight.end(), request));
+      readOnPool(std::unique_ptr<Request>{request});
+    }
+  }
+
+  // an armed wake read targets _wakeCount until it completes; an eventfd write completes it.
+  if(isWakeArmed)
+    wakeIo();
+
+  // the kernel posts completions without being entered; sleeping lets it run the work which
+  // posts some of them on this thread.
+  while(isWakeArmed || !_inFlight.empty()){
+    io_uring_cqe cqe {};
+    if(!_ring->popCqe(cqe)){
+      std::this_thread::sleep_for(std::chrono::milliseconds{1});
+      continue;
+    }
+    if(cqe.user_data == WAKE_TAG)
+      isWakeArmed = false;
+    else{
+      Request* request {reinterpret_cast<Request*>(cqe.user_data)};
+      _inFlight.erase(std::find(_inFlight.begin(), _inFlight.end(), request));
+      readOnPool(std::unique_ptr<Request>{request});
+    }
+  }
+
+  for(std::unique_ptr<Request>& request : pending)
+    readOnPool(std::move(request));
+  pending.clear();
+}
+
+#else
+
+void BmpAsyncLoader::wakeIo() {}
+void BmpAsyncLoader::runIo() {}
+void BmpAsyncLoader::startRead(std::unique_ptr<Request> request) {decode(std::move(request));}
+void BmpAsyncLoader::continueRead(Request* /*request*/, int /*result*/) {}
+void BmpAsyncLoader::submitRead(Request* /*request*/) {}
+void BmpAsyncLoader::failIo(std::deque<std::unique_ptr<Request>>& /*pending*/, bool /*isWakeArmed*/) {}
+
+#endif
+
+void BmpAsyncLoader::decode(std::unique_ptr<Request> request)
+{
+#ifdef BMP_HAS_IO_URING
+  if(request->_fd >= 0){
+    close(request->_fd);
+    request->_fd = -1;
+  }
+#endif
+
+  Request* task {request.release()};
+  _pool.submit([task](){
+    std::unique_ptr<Request> request {task};
+    Result result {request->_error == BmpBatchLoader::ERROR_NONE ? decodeBytes(request->_bytes) : makeError(request->_error)};
+    request->_bytes = std::vector<uint8_t>{};
+    request->_onLoaded(std::move(result));
+  });
+}
+
+// reads and decodes the whole file on the pool; any bytes already read are discarded.
+void BmpAsyncLoader::readOnPool(std::unique_ptr<Request> request)
+{
+#ifdef BMP_HAS_IO_URING
+  if(request->_fd >= 0){
+    close(request->_fd);
+    request->_fd = -1;
+  }
+#endif
+  request->_bytes = std::vector<uint8_t>{};
+
+  Request* task {request.release()};
+  _pool.submit([task](){
+    std::unique_ptr<Request> request {task};
+    request->_onLoaded(BmpBatchLoader::decodeFile(request->_filename));
+  });
+}
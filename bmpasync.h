@@ -0,0 +1,74 @@
+#ifndef _BMP_ASYNC_H_
+#define _BMP_ASYNC_H_
+
+//----------------------------------------------------------------------------------------------//
+// FILE: bmpasync.h                                                                             //
+// AUTHOR: Ian Murfin - github.com/ianmurfinxyz                                                 //
+//----------------------------------------------------------------------------------------------//
+
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "bmploader.h"
+#include "threadpool.h"
+
+// Loads bitmap files without blocking the calling thread. On linux an io thread keeps the reads
+// of many files in flight at once through io_uring, and hands each file to the decode pool as
+// soon as all its bytes have arrived. Elsewhere, or where io_uring is unavailable, each file is
+// read and decoded by a single task on the pool.
+class BmpAsyncLoader
+{
+public:
+  using Result = BmpBatchLoader::Result;
+
+  // called on a pool thread once the file is decoded (or has failed to).
+  using Callback = std::function<void(Result&&)>;
+
+public:
+  // numThreads of 0 uses one decode thread per hardware thread.
+  explicit BmpAsyncLoader(int numThreads = 0);
+
+  // blocks until every load already requested has completed.
+  ~BmpAsyncLoader();
+
+  BmpAsyncLoader(const BmpAsyncLoader&) = delete;
+  BmpAsyncLoader& operator=(const BmpAsyncLoader&) = delete;
+
+  std::future<Result> load(std::string filename);
+  void load(std::string filename, Callback onLoaded);
+
+  bool isUsingIoRing() const {return _ring != nullptr;}
+
+private:
+  class IoRing;
+  struct Request;
+
+private:
+  void runIo();
+  void startRead(std::unique_ptr<Request> request);
+  void continueRead(Request* request, int result);
+  void submitRead(Request* request);
+  void decode(std::unique_ptr<Request> request);
+  void readOnPool(std::unique_ptr<Request> request);
+  void failIo(std::deque<std::unique_ptr<Request>>& pending, bool isWakeArmed);
+  void wakeIo();
+
+private:
+  ThreadPool _pool;
+  std::unique_ptr<IoRing> _ring;
+  std::thread _ioThread;
+  std::mutex _mutex;
+  std::deque<std::unique_ptr<Request>> _requests;
+  bool _isStopping;
+  bool _isIoFailed;
+  int _wakeFd;
+  uint64_t _wakeCount;
+  std::vector<Request*> _inFlight;
+};
+
+#endif
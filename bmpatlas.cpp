@@ -0,0 +1,244 @@
+//----------------------------------------------------------------------------------------------//
+// FILE: bmpatlas.cpp                                                                           //
+// AUTHOR: Ian Murfin - github.com/ianmurfinxyz                                                 //
+//----------------------------------------------------------------------------------------------//
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include "bmpatlas.h"
+
+namespace
+{
+
+constexpr const char* cacheMagic {"bmpatlas"};
+constexpr int cacheVersion {1};
+
+// a horizontal span of the top edge of the packed area of a page; the spans cover the full
+// page width in order of x.
+struct SkylineNode
+{
+  int _x;
+  int _y;
+  int _width_px;
+};
+
+// the lowest y at which a w by h rect fits with its left edge on the given node, or -1.
+int fitRect(const std::vector<SkylineNode>& skyline, size_t node, int w, int h, int pageSize_px)
+{
+  if(skyline[node]._x + w > pageSize_px)
+    return -1;
+
+  int y {0};
+  int widthLeft {w};
+  for(size_t i = node; widthLeft > 0; ++i){
+    y = std::max(y, skyline[i]._y);
+    if(y + h > pageSize_px)
+      return -1;
+    widthLeft -= skyline[i]._width_px;
+  }
+  return y;
+}
+
+// places the rect bottom-left: lowest top edge first, then on the narrowest node, which leaves
+// the wider gaps for the rects still to come. Returns false if it fits nowhere on the page.
+bool placeRect(std::vector<SkylineNode>& skyline, int w, int h, int pageSize_px, int& x, int& y)
+{
+  int bestTop {INT_MAX};
+  int bestWidth {INT_MAX};
+  size_t bestNode {0};
+  for(size_t i = 0; i < skyline.size(); ++i){
+    int fitY {fitRect(skyline, i, w, h, pageSize_px)};
+    if(fitY < 0)
+      continue;
+    if(fitY + h < bestTop || (fitY + h == bestTop && skyline[i]._width_px < bestWidth)){
+      bestTop = fitY + h;
+      bestWidth = skyline[i]._width_px;
+      bestNode = i;
+      y = fitY;
+    }
+  }
+  if(bestTop == INT_MAX)
+    return false;
+
+  x = skyline[bestNode]._x;
+  skyline.insert(skyline.begin() + bestNode, SkylineNode{x, y + h, w});
+
+  // the nodes the rect now covers shrink or go.
+  for(size_t i = bestNode + 1; i < skyline.size();){
+    int overlap {(x + w) - skyline[i]._x};
+    if(overlap <= 0)
+      break;
+    skyline[i]._x += overlap;
+    skyline[i]._width_px -= overlap;
+    if(skyline[i]._width_px > 0)
+      break;
+    skyline.erase(skyline.begin() + i);
+  }
+
+  for(size_t i = 0; i + 1 < skyline.size();){
+    if(skyline[i]._y == skyline[i + 1]._y){
+      skyline[i]._width_px += skyline[i + 1]._width_px;
+      skyline.erase(skyline.begin() + i + 1);
+    }
+    else
+      ++i;
+  }
+
+  return true;
+}
+
+} // namespace
+
+BmpAtlas::BmpAtlas(int pageSize_px) :
+  _pageSize_px{pageSize_px},
+  _rects{},
+  _pages{},
+  _isFromCache{false}
+{}
+
+int BmpAtlas::build(const std::vector<Image>& images, const std::string& cacheFilename)
+{
+  clear();
+
+  _isFromCache = !cacheFilename.empty() && loadPacking(cacheFilename, images) == 0;
+  if(!_isFromCache){
+    if(pack(images) != 0){
+      clear();
+      return -1;
+    }
+    // a failed save only costs the next run a repack.
+    if(!cacheFilename.empty())
+      savePacking(cacheFilename);
+  }
+
+  fillPages(images);
+  return 0;
+}
+
+int BmpAtlas::pack(const std::vector<Image>& images)
+{
+  for(const Image& image : images)
+    if(image._width_px > _pageSize_px || image._height_px > _pageSize_px)
+      return -1;
+
+  // tallest first packs tighter on a skyline; ties keep their input order so packing does not
+  // depend on the sort implementation.
+  std::vector<int> order(images.size());
+  for(size_t i = 0; i < order.size(); ++i)
+    order[i] = static_cast<int>(i);
+  std::stable_sort(order.begin(), order.end(), [&images](int a, int b){
+    if(images[a]._height_px != images[b]._height_px)
+      return images[a]._height_px > images[b]._height_px;
+    return images[a]._width_px > images[b]._width_px;
+  });
+
+  std::vector<std::vector<SkylineNode>> skylines {};
+  _rects.assign(images.size(), Rect{0, 0, 0, 0, 0});
+  for(int i : order){
+    int w {std::max(images[i]._width_px, 0)};
+    int h {std::max(images[i]._height_px, 0)};
+    Rect& rect {_rects[i]};
+    rect._width_px = w;
+    rect._height_px = h;
+    if(w == 0 || h == 0)
+      continue;
+
+    for(rect._page = 0; rect._page < static_cast<int>(skylines.size()); ++rect._page)
+      if(placeRect(skylines[rect._page], w, h, _pageSize_px, rect._x, rect._y))
+        break;
+
+    if(rect._page == static_cast<int>(skylines.size())){
+      skylines.push_back({SkylineNode{0, 0, _pageSize_px}});
+      _pages.push_back(Page{{}, _pageSize_px, 0});
+      placeRect(skylines.back(), w, h, _pageSize_px, rect._x, rect._y);
+    }
+
+    Page& page {_pages[rect._page]};
+    page._height_px = std::max(page._height_px, rect._y + h);
+  }
+
+  return 0;
+}
+
+// the cache is a small text file: a header, the page heights, then one placement per image.
+int BmpAtlas::loadPacking(const std::string& filename, const std::vector<Image>& images)
+{
+  std::ifstream file {filename};
+  if(!file)
+    return -1;
+
+  std::string magic {};
+  int version {0}, pageSize_px {0}, numPages {0};
+  size_t numImages {0};
+  file >> magic >> version >> pageSize_px >> numImages >> numPages;
+  if(!file || magic != cacheMagic || version != cacheVersion || pageSize_px != _pageSize_px || numImages != images.size() || numPages < 0)
+    return -1;
+
+  std::vector<Page> pages(numPages, Page{{}, _pageSize_px, 0});
+  for(Page& page : pages){
+    file >> page._height_px;
+    if(!file || page._height_px < 0 || page._height_px > _pageSize_px)
+      return -1;
+  }
+
+  // the placements are only valid for the sizes they were packed for.
+  std::vector<Rect> rects(numImages);
+  for(size_t i = 0; i < numImages; ++i){
+    Rect& rect {rects[i]};
+    file >> rect._width_px >> rect._height_px >> rect._page >> rect._x >> rect._y;
+    if(!file || rect._width_px != std::max(images[i]._width_px, 0) || rect._height_px != std::max(images[i]._height_px, 0))
+      return -1;
+    if(rect._width_px == 0 || rect._height_px == 0)
+      continue;
+    if(rect._page < 0 || rect._page >= numPages || rect._x < 0 || rect._y < 0)
+      return -1;
+    if(rect._x + rect._width_px > _pageSize_px || rect._y + rect._height_px > pages[rect._page]._height_px)
+      return -1;
+  }
+
+  _rects = std::move(rects);
+  _pages = std::move(pages);
+  return 0;
+}
+
+int BmpAtlas::savePacking(const std::string& filename) const
+{
+  std::ofstream file {filename, std::ios::trunc};
+  if(!file)
+    return -1;
+
+  file << cacheMagic << ' ' << cacheVersion << ' ' << _pageSize_px << ' ' << _rects.size() << ' ' << _pages.size() << '\n';
+  for(const Page& page : _pages)
+    file << page._height_px << '\n';
+  for(const Rect& rect : _rects)
+    file << rect._width_px << ' ' << rect._height_px << ' ' << rect._page << ' ' << rect._x << ' ' << rect._y << '\n';
+
+  return file ? 0 : -1;
+}
+
+void BmpAtlas::fillPages(const std::vector<Image>& images)
+{
+  for(Page& page : _pages)
+    page._pixels.assign(static_cast<size_t>(page._width_px) * page._height_px, Color4{});
+
+  for(size_t i = 0; i < images.size(); ++i){
+    const Rect& rect {_rects[i]};
+    if(rect._width_px == 0 || rect._height_px == 0)
+      continue;
+    Page& page {_pages[rect._page]};
+    for(int row = 0; row < rect._height_px; ++row){
+      Color4* dst {page._pixels.data() + rect._x + (static_cast<size_t>(rect._y + row) * page._width_px)};
+      const Color4* src {images[i]._pixels + (static_cast<size_t>(row) * rect._width_px)};
+      std::memcpy(dst, src, rect._width_px * sizeof(Color4));
+    }
+  }
+}
+
+void BmpAtlas::clear()
+{
+  _rects.clear();
+  _pages.clear();
+  _isFromCache = false;
+}
@@ -0,0 +1,81 @@
+#ifndef _BMP_ATLAS_H_
+#define _BMP_ATLAS_H_
+
+//----------------------------------------------------------------------------------------------//
+// FILE: bmpatlas.h                                                                             //
+// AUTHOR: Ian Murfin - github.com/ianmurfinxyz                                                 //
+//----------------------------------------------------------------------------------------------//
+
+#include <string>
+#include <vector>
+#include "color.h"
+
+// Packs many small images into a few large pages of pixels, so that drawing them reads from one
+// contiguous surface rather than from a separate allocation per image. Images are placed with a
+// skyline bottom-left packer, tallest first; when an image fits in no existing page a new page
+// is started. Pages share the layout of BmpImage::getPixels, and each page is trimmed to the
+// height actually used.
+//
+// Packing is deterministic for a given list of image sizes, and the placements can be saved to
+// a cache file and reused by later runs which pack the same sizes.
+class BmpAtlas
+{
+public:
+  static constexpr int DEFAULT_PAGE_SIZE_PX {2048};
+
+  struct Image
+  {
+    const Color4* _pixels;   // as BmpImage::getPixels.
+    int _width_px;
+    int _height_px;
+  };
+
+  // where an image was placed; coordinates are from the bottom left of its page.
+  struct Rect
+  {
+    int _page;
+    int _x;
+    int _y;
+    int _width_px;
+    int _height_px;
+  };
+
+  struct Page
+  {
+    std::vector<Color4> _pixels;   // as BmpImage::getPixels.
+    int _width_px;
+    int _height_px;
+  };
+
+public:
+  explicit BmpAtlas(int pageSize_px = DEFAULT_PAGE_SIZE_PX);
+  ~BmpAtlas() = default;
+
+  // packs the images into pages, replacing any previous build; the handle of each image is its
+  // index in images. If a cache file is given, the placements it holds are reused when they
+  // were packed for the same image sizes, otherwise the images are packed and the placements
+  // written to it. Fails if an image is larger than a page.
+  int build(const std::vector<Image>& images, const std::string& cacheFilename = std::string{});
+
+  int getNumPages() const {return static_cast<int>(_pages.size());}
+  const Page& getPage(int page) const {return _pages[page];}
+  const Rect& getRect(int handle) const {return _rects[handle];}
+
+  // true if the last build reused the placements from its cache file.
+  bool isFromCache() const {return _isFromCache;}
+
+private:
+  int pack(const std::vector<Image>& images);
+  int loadPacking(const std::string& filename, const std::vector<Image>& images);
+  int savePacking(const std::string& filename) const;
+  void fillPages(const std::vector<Image>& images);
+  void clear();
+
+private:
+  int _pageSize_px;
+  std::vector<Rect> _rects;
+  std::vector<Page> _pages;
+  bool _isFromCache;
+};
+
+#endif
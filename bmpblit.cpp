@@ -0,0 +1,356 @@
+//----------------------------------------------------------------------------------------------//
+// FILE: bmpblit.cpp                                                                            //
+// AUTHOR: Ian Murfin - github.com/ianmurfinxyz                                                 //
+//----------------------------------------------------------------------------------------------//
+
+#include <algorithm>
+#include <cstring>
+#include "bmpblit.h"
+#include "bmpsimd.h"
+
+static_assert(sizeof(Color4) == 4, "the span blitters treat colors as packed rgba bytes");
+
+namespace
+{
+
+// Span blitters blit one clipped row of the source onto the target; key is the color key as
+// packed rgba bytes, read only by the color key blitters.
+using SpanBlitter = void (*)(const Color4* source, Color4* target, int width_px, uint32_t key);
+
+// packed rgba bytes read as a little endian word, so red is the low byte and alpha the high.
+constexpr uint32_t RGB_BITS {0x00ffffff};
+constexpr uint32_t ALPHA_BITS {0xff000000};
+
+// x / 255 rounded to nearest for x in [0, 255 * 255]; the vector blitters compute the same
+// with a multiply high by 257.
+uint8_t div255(uint32_t x)
+{
+  x += 128;
+  return static_cast<uint8_t>((x + (x >> 8)) >> 8);
+}
+
+void copySpan(const Color4* source, Color4* target, int width_px, uint32_t /*key*/)
+{
+  std::memcpy(target, source, width_px * sizeof(Color4));
+}
+
+void keySpanScalar(const Color4* source, Color4* target, int width_px, uint32_t key)
+{
+  for(int j = 0; j < width_px; ++j){
+    uint32_t bits;
+    std::memcpy(&bits, source + j, sizeof(bits));
+    if((bits & RGB_BITS) != key)
+      target[j] = source[j];
+  }
+}
+
+// every channel, alpha included, is (s * a + t * (255 - a)) / 255 with the source alpha
+// channel taken as 255, so fully opaque and fully clear pixels need no special case.
+void blendSpanScalar(const Color4* source, Color4* target, int width_px, uint32_t /*key*/)
+{
+  for(int j = 0; j < width_px; ++j){
+    const Color4& s {source[j]};
+    Color4& t {target[j]};
+    uint32_t a {s.getAlpha()};
+    uint32_t ia {255 - a};
+    t = Color4{
+      div255((s.getRed() * a) + (t.getRed() * ia)),
+      div255((s.getGreen() * a) + (t.getGreen() * ia)),
+      div255((s.getBlue() * a) + (t.getBlue() * ia)),
+      div255((255 * a) + (t.getAlpha() * ia))
+    };
+  }
+}
+
+// Row scalers write each of count source pixels scale times over, into count * scale pixels.
+using RowScaler = void (*)(const Color4* source, Color4* target, int count, int scale);
+
+void scaleRowScalar(const Color4* source, Color4* target, int count, int scale)
+{
+  for(int j = 0; j < count; ++j)
+    for(int k = 0; k < scale; ++k)
+      *target++ = source[j];
+}
+
+#ifdef BMP_HAS_X86_SIMD
+
+// note: runs of pixels which are all keyed or all clear are neither loaded from nor stored to
+// the target, and runs which are all opaque are stored without being loaded.
+
+__attribute__((target("ssse3")))
+void keySpanSsse3(const Color4* source, Color4* target, int width_px, uint32_t key)
+{
+  const __m128i rgbMask = _mm_set1_epi32(static_cast<int>(RGB_BITS));
+  const __m128i keys = _mm_set1_epi32(static_cast<int>(key));
+  int j {0};
+  for(; j + 4 <= width_px; j += 4){
+    __m128i s {_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + j))};
+    __m128i isKeyed {_mm_cmpeq_epi32(_mm_and_si128(s, rgbMask), keys)};
+    int keyedBits {_mm_movemask_epi8(isKeyed)};
+    if(keyedBits == 0xffff)
+      continue;
+    if(keyedBits != 0){
+      __m128i t {_mm_loadu_si128(reinterpret_cast<const __m128i*>(target + j))};
+      s = _mm_or_si128(_mm_and_si128(isKeyed, t), _mm_andnot_si128(isKeyed, s));
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(target + j), s);
+  }
+  keySpanScalar(source + j, target + j, width_px - j, key);
+}
+
+__attribute__((target("avx2")))
+void keySpanAvx2(const Color4* source, Color4* target, int width_px, uint32_t key)
+{
+  const __m256i rgbMask = _mm256_set1_epi32(static_cast<int>(RGB_BITS));
+  const __m256i keys = _mm256_set1_epi32(static_cast<int>(key));
+  int j {0};
+  for(; j + 8 <= width_px; j += 8){
+    __m256i s {_mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + j))};
+    __m256i isKeyed {_mm256_cmpeq_epi32(_mm256_and_si256(s, rgbMask), keys)};
+    int keyedBits {_mm256_movemask_epi8(isKeyed)};
+    if(keyedBits == -1)
+      continue;
+    if(keyedBits != 0){
+      __m256i t {_mm256_loadu_si256(reinterpret_cast<const __m256i*>(target + j))};
+      s = _mm256_blendv_epi8(s, t, isKeyed);
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(target + j), s);
+  }
+  _mm256_zeroupper();
+  keySpanSsse3(source + j, target + j, width_px - j, key);
+}
+
+// blends two pixels widened to 16 bit channels; alphas holds each pixel's alpha in all 4 of
+// its channels. Exact for the full range, as s * a + t * (255 - a) + 128 fits 16 bits.
+__attribute__((target("ssse3")))
+__m128i blendWide(__m128i s, __m128i t, __m128i alphas)
+{
+  const __m128i max = _mm_set1_epi16(255);
+  const __m128i half = _mm_set1_epi16(128);
+  const __m128i by257 = _mm_set1_epi16(257);
+  __m128i sum {_mm_add_epi16(_mm_mullo_epi16(s, alphas), _mm_mullo_epi16(t, _mm_sub_epi16(max, alphas)))};
+  return _mm_mulhi_epu16(_mm_add_epi16(sum, half), by257);
+}
+
+__attribute__((target("ssse3")))
+void blendSpanSsse3(const Color4* source, Color4* target, int width_px, uint32_t key)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i alphaMask = _mm_set1_epi32(static_cast<int>(ALPHA_BITS));
+  const __m128i alphasLo = _mm_setr_epi8(3, -1, 3, -1, 3, -1, 3, -1, 7, -1, 7, -1, 7, -1, 7, -1);
+  const __m128i alphasHi = _mm_setr_epi8(11, -1, 11, -1, 11, -1, 11, -1, 15, -1, 15, -1, 15, -1, 15, -1);
+  int j {0};
+  for(; j + 4 <= width_px; j += 4){
+    __m128i s {_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + j))};
+    __m128i alphas {_mm_and_si128(s, alphaMask)};
+    if(_mm_movemask_epi8(_mm_cmpeq_epi32(alphas, zero)) == 0xffff)
+      continue;
+    if(_mm_movemask_epi8(_mm_cmpeq_epi32(alphas, alphaMask)) != 0xffff){
+      __m128i t {_mm_loadu_si128(reinterpret_cast<const __m128i*>(target + j))};
+      __m128i opaqueS {_mm_or_si128(s, alphaMask)};
+      __m128i lo {blendWide(_mm_unpacklo_epi8(opaqueS, zero), _mm_unpacklo_epi8(t, zero), _mm_shuffle_epi8(s, alphasLo))};
+      __m128i hi {blendWide(_mm_unpackhi_epi8(opaqueS, zero), _mm_unpackhi_epi8(t, zero), _mm_shuffle_epi8(s, alphasHi))};
+      s = _mm_packus_epi16(lo, hi);
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(target + j), s);
+  }
+  blendSpanScalar(source + j, target + j, width_px - j, key);
+}
+
+__attribute__((target("avx2")))
+__m256i blendWideAvx2(__m256i s, __m256i t, __m256i alphas)
+{
+  const __m256i max = _mm256_set1_epi16(255);
+  const __m256i half = _mm256_set1_epi16(128);
+  const __m256i by257 = _mm256_set1_epi16(257);
+  __m256i sum {_mm256_add_epi16(_mm256_mullo_epi16(s, alphas), _mm256_mullo_epi16(t, _mm256_sub_epi16(max, alphas)))};
+  return _mm256_mulhi_epu16(_mm256_add_epi16(sum, half), by257);
+}
+
+// the unpacks and packs work within each 128 bit lane, so the lanes are blended as two
+// independent groups of 4 pixels and come back in order.
+__attribute__((target("avx2")))
+void blendSpanAvx2(const Color4* source, Color4* target, int width_px, uint32_t key)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i alphaMask = _mm256_set1_epi32(static_cast<int>(ALPHA_BITS));
+  const __m256i alphasLo = _mm256_setr_epi8(
+    3, -1, 3, -1, 3, -1, 3, -1, 7, -1, 7, -1, 7, -1, 7, -1,
+    3, -1, 3, -1, 3, -1, 3, -1, 7, -1, 7, -1, 7, -1, 7, -1);
+  const __m256i alphasHi = _mm256_setr_epi8(
+    11, -1, 11, -1, 11, -1, 11, -1, 15, -1, 15, -1, 15, -1, 15, -1,
+    11, -1, 11, -1, 11, -1, 11, -1, 15, -1, 15, -1, 15, -1, 15, -1);
+  int j {0};
+  for(; j + 8 <= width_px; j += 8){
+    __m256i s {_mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + j))};
+    __m256i alphas {_mm256_and_si256(s, alphaMask)};
+    if(_mm256_movemask_epi8(_mm256_cmpeq_epi32(alphas, zero)) == -1)
+      continue;
+    if(_mm256_movemask_epi8(_mm256_cmpeq_epi32(alphas, alphaMask)) != -1){
+      __m256i t {_mm256_loadu_si256(reinterpret_cast<const __m256i*>(target + j))};
+      __m256i opaqueS {_mm256_or_si256(s, alphaMask)};
+      __m256i lo {blendWideAvx2(_mm256_unpacklo_epi8(opaqueS, zero), _mm256_unpacklo_epi8(t, zero), _mm256_shuffle_epi8(s, alphasLo))};
+      __m256i hi {blendWideAvx2(_mm256_unpackhi_epi8(opaqueS, zero), _mm256_unpackhi_epi8(t, zero), _mm256_shuffle_epi8(s, alphasHi))};
+      s = _mm256_packus_epi16(lo, hi);
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(target + j), s);
+  }
+  _mm256_zeroupper();
+  blendSpanSsse3(source + j, target + j, width_px - j, key);
+}
+
+// scales of 2 and 3 spread 4 source pixels over 2 or 3 whole vectors; larger scales store each
+// pixel as one vector repeated, the last store overlapping the one before where the scale is
+// not a multiple of 4. There is no avx2 scaler as the target rows are stored at the full rate of
+// memory either way, and most target rows are copies of the row below.
+__attribute__((target("ssse3")))
+void scaleRowSsse3(const Color4* source, Color4* target, int count, int scale)
+{
+  int j {0};
+  switch(scale){
+  case 1:
+    std::memcpy(target, source, count * sizeof(Color4));
+    return;
+  case 2:
+    for(; j + 4 <= count; j += 4){
+      __m128i s {_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + j))};
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(target + (j * 2)), _mm_unpacklo_epi32(s, s));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(target + (j * 2) + 4), _mm_unpackhi_epi32(s, s));
+    }
+    break;
+  case 3:
+    for(; j + 4 <= count; j += 4){
+      __m128i s {_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + j))};
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(target + (j * 3)), _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 0, 0)));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(target + (j * 3) + 4), _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 2, 1, 1)));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(target + (j * 3) + 8), _mm_shuffle_epi32(s, _MM_SHUFFLE(3, 3, 3, 2)));
+    }
+    break;
+  default:
+    for(; j < count; ++j){
+      int bits;
+      std::memcpy(&bits, source + j, sizeof(bits));
+      __m128i pixel {_mm_set1_epi32(bits)};
+      Color4* square {target + (j * scale)};
+      for(int k = 0; k + 4 <= scale; k += 4)
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(square + k), pixel);
+      if(scale % 4 != 0)
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(square + scale - 4), pixel);
+    }
+    return;
+  }
+  scaleRowScalar(source + j, target + (j * scale), count - j, scale);
+}
+
+#endif
+
+// indexed by BlitMode then SimdLevel; nullptr where no kernel exists. Opaque spans are plain
+// copies, which memcpy already does at the full width of the machine.
+const SpanBlitter spanBlitters[3][3] {
+  {copySpan, nullptr, nullptr},
+  {keySpanScalar, BMP_SIMD_KERNELS(keySpanSsse3, keySpanAvx2)},
+  {blendSpanScalar, BMP_SIMD_KERNELS(blendSpanSsse3, blendSpanAvx2)},
+};
+
+SpanBlitter selectSpanBlitter(BlitMode mode)
+{
+  int level {getSimdLevel()};
+  while(spanBlitters[mode][level] == nullptr)
+    --level;
+  return spanBlitters[mode][level];
+}
+
+const RowScaler rowScalers[3] {scaleRowScalar, BMP_SIMD_KERNELS(scaleRowSsse3, nullptr)};
+
+RowScaler selectRowScaler()
+{
+  int level {getSimdLevel()};
+  while(rowScalers[level] == nullptr)
+    --level;
+  return rowScalers[level];
+}
+
+// writes count copies of the pixel; for source pixels cut by the clip.
+void fillPixels(Color4* target, int count, const Color4& pixel)
+{
+  for(int k = 0; k < count; ++k)
+    target[k] = pixel;
+}
+
+} // namespace
+
+BlitRect blit(const BlitSource& source, const BlitTarget& target, int x, int y, BlitMode mode, Color4 colorKey)
+{
+  // clip in 64 bits so positions far off the target cannot overflow.
+  int64_t x0 {std::max<int64_t>(x, 0)};
+  int64_t y0 {std::max<int64_t>(y, 0)};
+  int64_t x1 {std::min<int64_t>(static_cast<int64_t>(x) + source._width_px, target._width_px)};
+  int64_t y1 {std::min<int64_t>(static_cast<int64_t>(y) + source._height_px, target._height_px)};
+  if(x0 >= x1 || y0 >= y1)
+    return BlitRect{0, 0, 0, 0};
+
+  BlitRect area {static_cast<int>(x0), static_cast<int>(y0), static_cast<int>(x1 - x0), static_cast<int>(y1 - y0)};
+
+  uint32_t key;
+  std::memcpy(&key, &colorKey, sizeof(key));
+  key &= RGB_BITS;
+
+  SpanBlitter blitSpan {selectSpanBlitter(mode)};
+  const Color4* sourceRow {source._pixels + (area._x - x) + (static_cast<int64_t>(area._y - y) * source._stride_px)};
+  Color4* targetRow {target._pixels + area._x + (static_cast<int64_t>(area._y) * target._stride_px)};
+  for(int row = 0; row < area._height_px; ++row){
+    blitSpan(sourceRow, targetRow, area._width_px, key);
+    sourceRow += source._stride_px;
+    targetRow += target._stride_px;
+  }
+
+  return area;
+}
+
+BlitRect blitScaled(const BlitSource& source, const BlitTarget& target, int x, int y, int scale)
+{
+  if(scale < 1)
+    return BlitRect{0, 0, 0, 0};
+
+  int64_t x0 {std::max<int64_t>(x, 0)};
+  int64_t y0 {std::max<int64_t>(y, 0)};
+  int64_t x1 {std::min<int64_t>(x + (static_cast<int64_t>(source._width_px) * scale), target._width_px)};
+  int64_t y1 {std::min<int64_t>(y + (static_cast<int64_t>(source._height_px) * scale), target._height_px)};
+  if(x0 >= x1 || y0 >= y1)
+    return BlitRect{0, 0, 0, 0};
+
+  BlitRect area {static_cast<int>(x0), static_cast<int>(y0), static_cast<int>(x1 - x0), static_cast<int>(y1 - y0)};
+
+  // the clip may cut through the first and last source pixels of each row.
+  int64_t offset {area._x - static_cast<int64_t>(x)};
+  int firstCol {static_cast<int>(offset / scale)};
+  int lead {std::min(static_cast<int>((scale - (offset % scale)) % scale), area._width_px)};
+  int numWhole {(area._width_px - lead) / scale};
+  int trail {(area._width_px - lead) % scale};
+
+  RowScaler scaleRow {selectRowScaler()};
+  Color4* targetRow {target._pixels + area._x + (static_cast<int64_t>(area._y) * target._stride_px)};
+  int64_t lastSourceRow {-1};
+  for(int row = 0; row < area._height_px; ++row, targetRow += target._stride_px){
+    // each source row is scaled once, into the lowest target row it covers; the target rows
+    // above are copies of that.
+    int64_t sourceRow {((area._y + row) - static_cast<int64_t>(y)) / scale};
+    if(sourceRow == lastSourceRow){
+      std::memcpy(targetRow, targetRow - target._stride_px, area._width_px * sizeof(Color4));
+      continue;
+    }
+    lastSourceRow = sourceRow;
+
+    const Color4* sourcePixels {source._pixels + firstCol + (sourceRow * source._stride_px)};
+    Color4* out {targetRow};
+    if(lead > 0){
+      fillPixels(out, lead, *sourcePixels++);
+      out += lead;
+    }
+    scaleRow(sourcePixels, out, numWhole, scale);
+    if(trail > 0)
+      fillPixels(out + (numWhole * scale), trail, sourcePixels[numWhole]);
+  }
+
+  return area;
+}
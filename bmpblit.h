@@ -0,0 +1,58 @@
+#ifndef _BMP_BLIT_H_
+#define _BMP_BLIT_H_
+
+//----------------------------------------------------------------------------------------------//
+// FILE: bmpblit.h                                                                              //
+// AUTHOR: Ian Murfin - github.com/ianmurfinxyz                                                 //
+//----------------------------------------------------------------------------------------------//
+
+#include "color.h"
+
+// Blits copy a rectangle of pixels from one surface onto another. Both surfaces share the
+// layout of BmpImage::getPixels, bottom row first, with rows stride pixels apart so a surface
+// may be a region of a larger one such as an atlas page.
+enum BlitMode
+{
+  BLIT_OPAQUE,      // every source pixel replaces the target pixel.
+  BLIT_COLOR_KEY,   // source pixels whose rgb equals the key's are skipped; alpha is ignored.
+  BLIT_ALPHA        // source over target, with non premultiplied source alpha.
+};
+
+struct BlitSource
+{
+  const Color4* _pixels;
+  int _width_px;
+  int _height_px;
+  int _stride_px;
+};
+
+struct BlitTarget
+{
+  Color4* _pixels;
+  int _width_px;
+  int _height_px;
+  int _stride_px;
+};
+
+// the area of the target a blit covered; empty if the source fell wholly outside it.
+struct BlitRect
+{
+  int _x;
+  int _y;
+  int _width_px;
+  int _height_px;
+};
+
+// draws source with its bottom left corner at (x, y) on the target; the source may lie partly
+// or wholly off any edge of the target and is clipped to it. The source and target must not
+// overlap.
+//
+// Alpha blending rounds each channel to nearest, and the target alpha becomes the usual source
+// over alpha, so blending onto an opaque target leaves it opaque.
+BlitRect blit(const BlitSource& source, const BlitTarget& target, int x, int y, BlitMode mode = BLIT_OPAQUE, Color4 colorKey = Color4{});
+
+// draws source opaque and scaled up by a whole factor with nearest neighbour sampling, so each
+// source pixel covers a scale by scale square of the target; positioned and clipped as blit.
+BlitRect blitScaled(const BlitSource& source, const BlitTarget& target, int x, int y, int scale);
+
+#endif
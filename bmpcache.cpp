@@ -0,0 +1,134 @@
+//----------------------------------------------------------------------------------------------//
+// FILE: bmpcache.cpp                                                                           //
+// AUTHOR: Ian Murfin - github.com/ianmurfinxyz                                                 //
+//----------------------------------------------------------------------------------------------//
+
+#include <filesystem>
+#include "bmpcache.h"
+
+BmpCache::BmpCache(size_t budget_bytes) :
+  _mutex{},
+  _entries{},
+  _lru{},
+  _size_bytes{0},
+  _budget_bytes{budget_bytes},
+  _numHits{0},
+  _numMisses{0},
+  _numEvictions{0},
+  _nextLoadNo{0}
+{}
+
+BmpCache& BmpCache::getShared()
+{
+  static BmpCache cache {};
+  return cache;
+}
+
+BmpCache::ImagePtr BmpCache::load(const std::string& filename, BmpBatchLoader::Error* error)
+{
+  // a directory entry reads the size and modification time with a single stat.
+  std::error_code ec {};
+  std::filesystem::directory_entry file {filename, ec};
+  int64_t fileSize_bytes {ec ? -1 : static_cast<int64_t>(file.file_size(ec))};
+  int64_t modifyTime {ec ? -1 : static_cast<int64_t>(file.last_write_time(ec).time_since_epoch().count())};
+
+  std::unique_lock<std::mutex> lock {_mutex};
+
+  if(ec){
+    ++_numMisses;
+    if(error != nullptr)
+      *error = BmpBatchLoader::ERROR_OPEN;
+    return nullptr;
+  }
+
+  auto it = _entries.find(filename);
+  if(it != _entries.end() && it->second._modifyTime == modifyTime && it->second._fileSize_bytes == fileSize_bytes){
+    ++_numHits;
+    if(it->second._lruPos != _lru.end())
+      _lru.splice(_lru.begin(), _lru, it->second._lruPos);
+
+    // the image may still be being decoded by another loader.
+    std::shared_future<Loaded> loaded {it->second._loaded};
+    lock.unlock();
+    if(error != nullptr)
+      *error = loaded.get()._error;
+    return loaded.get()._image;
+  }
+
+  ++_numMisses;
+
+  // the file has changed since it was cached.
+  if(it != _entries.end()){
+    _size_bytes -= it->second._size_bytes;
+    if(it->second._lruPos != _lru.end())
+      _lru.erase(it->second._lruPos);
+    _entries.erase(it);
+  }
+
+  std::promise<Loaded> promise {};
+  uint64_t loadNo {_nextLoadNo++};
+  _entries[filename] = Entry{promise.get_future().share(), modifyTime, fileSize_bytes, 0, _lru.end(), loadNo};
+  lock.unlock();
+
+  BmpBatchLoader::Result result {BmpBatchLoader::decodeFile(filename)};
+  Loaded loaded {nullptr, result._error};
+  if(result._error == BmpBatchLoader::ERROR_NONE)
+    loaded._image = std::make_shared<const Image>(Image{std::move(result._pixels), result._width_px, result._height_px});
+
+  lock.lock();
+
+  // the entry is gone if the cache was cleared, or replaced if the file changed, meanwhile.
+  it = _entries.find(filename);
+  if(it != _entries.end() && it->second._loadNo == loadNo){
+    size_t size_bytes {loaded._image ? loaded._image->_pixels.size() * sizeof(Color4) : 0};
+    if(loaded._image == nullptr || size_bytes > _budget_bytes){
+      _entries.erase(it);
+    }
+    else{
+      _lru.push_front(filename);
+      it->second._lruPos = _lru.begin();
+      it->second._size_bytes = size_bytes;
+      _size_bytes += size_bytes;
+      evict();
+    }
+  }
+
+  lock.unlock();
+  promise.set_value(loaded);
+
+  if(error != nullptr)
+    *error = loaded._error;
+  return loaded._image;
+}
+
+void BmpCache::setBudget(size_t budget_bytes)
+{
+  std::lock_guard<std::mutex> lock {_mutex};
+  _budget_bytes = budget_bytes;
+  evict();
+}
+
+void BmpCache::clear()
+{
+  std::lock_guard<std::mutex> lock {_mutex};
+  _entries.clear();
+  _lru.clear();
+  _size_bytes = 0;
+}
+
+BmpCache::Stats BmpCache::getStats() const
+{
+  std::lock_guard<std::mutex> lock {_mutex};
+  return Stats{_numHits, _numMisses, _numEvictions, _size_bytes, _budget_bytes, static_cast<int>(_lru.size())};
+}
+
+void BmpCache::evict()
+{
+  while(_size_bytes > _budget_bytes && !_lru.empty()){
+    auto it = _entries.find(_lru.back());
+    _size_bytes -= it->second._size_bytes;
+    _entries.erase(it);
+    _lru.pop_back();
+    ++_numEvictions;
+  }
+}
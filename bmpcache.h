@@ -0,0 +1,105 @@
+#ifndef _BMP_CACHE_H_
+#define _BMP_CACHE_H_
+
+//----------------------------------------------------------------------------------------------//
+// FILE: bmpcache.h                                                                             //
+// AUTHOR: Ian Murfin - github.com/ianmurfinxyz                                                 //
+//----------------------------------------------------------------------------------------------//
+
+#include <cinttypes>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "bmploader.h"
+#include "color.h"
+
+// A cache of decoded bitmaps shared by everything that loads them. Images are keyed by their
+// path, and are decoded again if the file's modification time or size has changed since they
+// were cached. Loaded images are handed out as shared immutable buffers; the least recently
+// loaded images are dropped from the cache to keep it within its byte budget, though an image
+// stays alive for as long as anyone holds it.
+//
+// Concurrent loads of a file not yet in the cache decode it only once; the other loaders wait
+// for that decode to finish.
+class BmpCache
+{
+public:
+  static constexpr size_t DEFAULT_BUDGET_BYTES {size_t{256} << 20};
+
+  struct Image
+  {
+    std::vector<Color4> _pixels;   // as BmpImage::getPixels.
+    int _width_px;
+    int _height_px;
+  };
+
+  using ImagePtr = std::shared_ptr<const Image>;
+
+  struct Stats
+  {
+    uint64_t _numHits;
+    uint64_t _numMisses;
+    uint64_t _numEvictions;
+    size_t _size_bytes;
+    size_t _budget_bytes;
+    int _numImages;
+  };
+
+public:
+  explicit BmpCache(size_t budget_bytes = DEFAULT_BUDGET_BYTES);
+  ~BmpCache() = default;
+  BmpCache(const BmpCache&) = delete;
+  BmpCache& operator=(const BmpCache&) = delete;
+
+  // the cache shared by the whole process.
+  static BmpCache& getShared();
+
+  // returns nullptr on failure, with the reason in error if given. Images bigger than the
+  // whole budget are loaded but not cached.
+  ImagePtr load(const std::string& filename, BmpBatchLoader::Error* error = nullptr);
+
+  // evicts images as needed to fit the new budget.
+  void setBudget(size_t budget_bytes);
+
+  // drops every cached image; images still held elsewhere are unaffected.
+  void clear();
+
+  Stats getStats() const;
+
+private:
+  struct Loaded
+  {
+    ImagePtr _image;
+    BmpBatchLoader::Error _error;
+  };
+
+  struct Entry
+  {
+    std::shared_future<Loaded> _loaded;
+    int64_t _modifyTime;
+    int64_t _fileSize_bytes;
+    size_t _size_bytes;                         // 0 until the decode has finished.
+    std::list<std::string>::iterator _lruPos;   // end of the lru list until then.
+    uint64_t _loadNo;                           // identifies the load which created the entry.
+  };
+
+private:
+  void evict();
+
+private:
+  mutable std::mutex _mutex;
+  std::unordered_map<std::string, Entry> _entries;
+  std::list<std::string> _lru;                  // most recently loaded first.
+  size_t _size_bytes;
+  size_t _budget_bytes;
+  uint64_t _numHits;
+  uint64_t _numMisses;
+  uint64_t _numEvictions;
+  uint64_t _nextLoadNo;
+};
+
+#endif
@@ -4,62 +4,1433 @@
 //----------------------------------------------------------------------------------------------//
 
 #include <cinttypes>
+#include <cstring>
+#include <algorithm>
 #include <vector>
 #include <fstream>
 #include <cmath>
+#include <atomic>
+#include <memory>
 #include "color.h"
 #include "bmpimage.h"
+#include "threadpool.h"
+#include "bmpsimd.h"
 
-int BmpImage::load(std::string filename)
+#if defined(__unix__) || defined(__APPLE__)
+#define BMP_HAS_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// define BMP_STATS to record the DecodeStats of each load; without it they compile out.
+#ifdef BMP_STATS
+#include <chrono>
+#include <mutex>
+#endif
+
+namespace
+{
+
+// Reads a little endian field from a byte buffer and advances the cursor past it.
+template<typename T>
+T readField(const uint8_t*& cursor)
+{
+  T value;
+  std::memcpy(&value, cursor, sizeof(T));
+  cursor += sizeof(T);
+  return value;
+}
+
+// Writes a little endian field to a byte buffer and advances the cursor past it.
+template<typename T>
+void writeField(uint8_t*& cursor, T value)
+{
+  std::memcpy(cursor, &value, sizeof(T));
+  cursor += sizeof(T);
+}
+
+// Laps the stages of a decode; each lap adds the time since the last lap (or since the clock
+// was made) to a stage's stat. Without BMP_STATS it does nothing.
+class StageClock
+{
+public:
+#ifdef BMP_STATS
+  StageClock() : _lapStart{Clock::now()} {}
+
+  void lap(int64_t& stage_ns)
+  {
+    Clock::time_point now {Clock::now()};
+    stage_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(now - _lapStart).count();
+    _lapStart = now;
+  }
+
+private:
+  using Clock = std::chrono::steady_clock;
+  Clock::time_point _lapStart;
+#else
+  void lap(int64_t&) {}
+#endif
+};
+
+// every field of DecodeStats, with its name in json.
+struct StatField
+{
+  const char* _name;
+  int64_t BmpImage::DecodeStats::* _field;
+};
+
+const StatField statFields[] {
+  {"numLoads",        &BmpImage::DecodeStats::_numLoads},
+  {"numFailedLoads",  &BmpImage::DecodeStats::_numFailedLoads},
+  {"total_ns",        &BmpImage::DecodeStats::_total_ns},
+  {"open_ns",         &BmpImage::DecodeStats::_open_ns},
+  {"headers_ns",      &BmpImage::DecodeStats::_headers_ns},
+  {"palette_ns",      &BmpImage::DecodeStats::_palette_ns},
+  {"read_ns",         &BmpImage::DecodeStats::_read_ns},
+  {"convert_ns",      &BmpImage::DecodeStats::_convert_ns},
+  {"mips_ns",         &BmpImage::DecodeStats::_mips_ns},
+  {"read_bytes",      &BmpImage::DecodeStats::_read_bytes},
+  {"numReads",        &BmpImage::DecodeStats::_numReads},
+  {"numSeeks",        &BmpImage::DecodeStats::_numSeeks},
+  {"numSyscalls",     &BmpImage::DecodeStats::_numSyscalls},
+  {"numAllocations",  &BmpImage::DecodeStats::_numAllocations},
+  {"allocated_bytes", &BmpImage::DecodeStats::_allocated_bytes},
+};
+
+#ifdef BMP_STATS
+// guards the totals, and the stats of an image while the threads of a parallel decode add to
+// them.
+std::mutex statsMutex {};
+BmpImage::DecodeStats totalStats {};
+
+void addStat(int64_t& stat, int64_t value)
+{
+  stat += value;
+}
+
+void addStats(BmpImage::DecodeStats& stats, const BmpImage::DecodeStats& more)
+{
+  std::lock_guard<std::mutex> lock {statsMutex};
+  for(const StatField& field : statFields)
+    stats.*field._field += more.*field._field;
+}
+
+void resetStats(BmpImage::DecodeStats& stats)
+{
+  stats = BmpImage::DecodeStats{};
+}
+
+// closes the stats of a load and adds them to the totals.
+void recordLoad(BmpImage::DecodeStats& stats, int result, StageClock& clock)
+{
+  clock.lap(stats._total_ns);
+  ++stats._numLoads;
+  stats._numFailedLoads += (result != 0);
+  addStats(totalStats, stats);
+}
+
+// counts an allocation if the vector grew from its old capacity.
+template<typename Vector>
+void countGrowth(const Vector& vector, size_t oldCapacity, BmpImage::DecodeStats& stats)
+{
+  if(vector.capacity() > oldCapacity){
+    ++stats._numAllocations;
+    stats._allocated_bytes += vector.capacity() * sizeof(typename Vector::value_type);
+  }
+}
+#else
+void addStat(int64_t&, int64_t) {}
+void addStats(BmpImage::DecodeStats&, const BmpImage::DecodeStats&) {}
+void resetStats(BmpImage::DecodeStats&) {}
+void recordLoad(BmpImage::DecodeStats&, int, StageClock&) {}
+
+template<typename Vector>
+void countGrowth(const Vector&, size_t, BmpImage::DecodeStats&) {}
+#endif
+
+template<typename Vector>
+void resizeCounted(Vector& vector, size_t size, BmpImage::DecodeStats& stats)
+{
+  size_t capacity {vector.capacity()};
+  vector.resize(size);
+  countGrowth(vector, capacity, stats);
+}
+
+// Channels wider than this are scaled arithmetically rather than through a lookup table.
+constexpr int MAX_CHANNEL_LUT_BITS {12};
+
+// A channel of a full color pixel. The masked bits are shifted down to bit 0 and scaled to the
+// full 8 bit range through a lookup table, which is only built for formats without a converter
+// of their own, and only for channels of at most MAX_CHANNEL_LUT_BITS.
+struct Channel
+{
+  uint32_t _mask;
+  int _shift;
+  int _width;
+  uint8_t _lut[1 << MAX_CHANNEL_LUT_BITS];
+};
+
+// The channel layout of a full color (16, 24 or 32bpp) pixel.
+struct PixelFormat
+{
+  int _bytesPerPixel;
+  Channel _red;
+  Channel _green;
+  Channel _blue;
+  Channel _alpha;
+};
+
+// Row converters decode a whole row of raw file pixels into Color4s in one call. A converter
+// is selected once per image so no per-pixel decisions are made on the pixel format.
+using RowConverter = void (*)(const uint8_t* row, Color4* pixels, int width_px, const PixelFormat& format);
+
+static_assert(sizeof(Color4) == 4, "row converters write Color4s as packed RGBA bytes");
+
+// The shift which moves the channel selected by mask down to bit 0; 0 for an empty mask.
+constexpr int maskShift(uint32_t mask)
+{
+  int shift {0};
+  if(mask == 0)
+    return shift;
+  while((mask & (uint32_t{0x01} << shift)) == 0)
+    ++shift;
+  return shift;
+}
+
+// The number of bits spanned by mask; 0 for an empty mask.
+constexpr int maskWidth(uint32_t mask)
+{
+  int width {0};
+  for(uint32_t bits {mask >> maskShift(mask)}; bits != 0; bits >>= 1)
+    ++width;
+  return width;
+}
+
+// An n bit channel value v is scaled to 8 bits as round(v * 255 / (2^n - 1)), which maps 0 to
+// 0 and the max to 255, by computing (v * _mul + _add) >> _shift. The constants were found by
+// exhaustive search, for each width, as the smallest giving exactly the rounded value for every
+// v; up to 8 bits the sums fit 16-bit lanes, and up to 15 bits _mul and v fit signed 16-bit
+// lanes (as pmaddwd requires).
+struct ChannelScale
+{
+  uint32_t _mul;
+  uint32_t _add;
+  int _shift;
+};
+
+constexpr ChannelScale channelScales[] {
+  {0, 0, 0},                                                                    // no channel.
+  {255, 0, 0},   {85, 0, 0},      {73, 0, 1},       {17, 0, 0},                 // 1-4 bits.
+  {1053, 60, 7}, {259, 33, 6},    {129, 0, 6},      {1, 0, 0},                  // 5-8 bits.
+  {1, 0, 1},     {1021, 2041, 12}, {2041, 8182, 14}, {4081, 32647, 16},         // 9-12 bits.
+  {8161, 131036, 18}, {16321, 524181, 20}, {32641, 2097024, 22}, {255, 32895, 16}   // 13-16 bits.
+};
+
+constexpr int MAX_SCALED_CHANNEL_BITS {16};
+
+template<uint32_t Mask>
+uint8_t scaleChannel(uint32_t rawPixelBytes)
+{
+  static_assert(maskWidth(Mask) <= MAX_SCALED_CHANNEL_BITS, "no scale constants for so wide a channel");
+  constexpr int shift {maskShift(Mask)};
+  constexpr ChannelScale scale {channelScales[maskWidth(Mask)]};
+  return static_cast<uint8_t>(((((rawPixelBytes & Mask) >> shift) * scale._mul) + scale._add) >> scale._shift);
+}
+
+// the branches depend only on the channel, so they are predicted perfectly across a row.
+uint8_t scaleChannel(uint32_t rawPixelBytes, const Channel& channel)
+{
+  uint32_t value {(rawPixelBytes & channel._mask) >> channel._shift};
+  if(channel._width <= MAX_CHANNEL_LUT_BITS)
+    return channel._lut[value];
+  if(channel._width <= MAX_SCALED_CHANNEL_BITS){
+    const ChannelScale& scale {channelScales[channel._width]};
+    return static_cast<uint8_t>(((value * scale._mul) + scale._add) >> scale._shift);
+  }
+  uint64_t max {(uint64_t{1} << channel._width) - 1};
+  return static_cast<uint8_t>(((value * uint64_t{255 * 2}) + max) / (max * 2));
+}
+
+// Sets the mask of a channel, building its lookup table if withLut and the channel is narrow
+// enough to have one. Scaling to 8 bits rounds as for channelScales.
+void buildChannel(uint32_t mask, bool withLut, Channel& channel)
+{
+  channel._mask = mask;
+  channel._shift = maskShift(mask);
+  channel._width = maskWidth(mask);
+  if(!withLut || channel._width > MAX_CHANNEL_LUT_BITS)
+    return;
+
+  uint64_t max {(uint64_t{1} << channel._width) - 1};
+  channel._lut[0] = 0;
+  for(uint64_t v = 1; v <= max; ++v)
+    channel._lut[v] = static_cast<uint8_t>(((v * 255 * 2) + max) / (max * 2));
+}
+
+// Gathers the bytes of a pixel with the 0rth byte in the LSB.
+template<int BytesPerPixel>
+uint32_t loadPixel(const uint8_t* bytes)
+{
+  uint32_t rawPixelBytes {0};
+  for(int k = 0; k < BytesPerPixel; ++k)
+    rawPixelBytes |= static_cast<uint32_t>(bytes[k]) << (k * 8);
+  return rawPixelBytes;
+}
+
+// A converter specialized on a well known layout; the stride, masks, shifts and scales are
+// all compile time constants so the loop body compiles to straight line code (and 8 bit
+// channels are not scaled at all).
+template<int BytesPerPixel, uint32_t RedMask, uint32_t GreenMask, uint32_t BlueMask, uint32_t AlphaMask>
+void convertRowMasked(const uint8_t* row, Color4* pixels, int width_px, const PixelFormat&)
+{
+  for(int j = 0; j < width_px; ++j, row += BytesPerPixel){
+    uint32_t rawPixelBytes {loadPixel<BytesPerPixel>(row)};
+    pixels[j] = Color4{
+      scaleChannel<RedMask>(rawPixelBytes),
+      scaleChannel<GreenMask>(rawPixelBytes),
+      scaleChannel<BlueMask>(rawPixelBytes),
+      scaleChannel<AlphaMask>(rawPixelBytes)
+    };
+  }
+}
+
+// The fallback for arbitrary BI_BITFIELDS layouts; reads the layout, and the channels' lookup
+// tables, from the format.
+void convertRowGeneric(const uint8_t* row, Color4* pixels, int width_px, const PixelFormat& format)
+{
+  for(int j = 0; j < width_px; ++j){
+    uint32_t rawPixelBytes {0};
+
+    // for each pixel byte.
+    for(int k = 0; k < format._bytesPerPixel; ++k){
+      uint8_t pixelByte = row[(j * format._bytesPerPixel) + k];
+
+      // 0rth byte of pixel stored in LSB of rawPixelBytes.
+      rawPixelBytes |= static_cast<uint32_t>(pixelByte) << (k * 8);
+    }
+
+    uint8_t red = scaleChannel(rawPixelBytes, format._red);
+    uint8_t green = scaleChannel(rawPixelBytes, format._green);
+    uint8_t blue = scaleChannel(rawPixelBytes, format._blue);
+    uint8_t alpha = scaleChannel(rawPixelBytes, format._alpha);
+
+    pixels[j] = Color4{red, green, blue, alpha};
+  }
+}
+
+constexpr RowConverter convertRowRgb565Scalar {convertRowMasked<2, 0x00f800, 0x0007e0, 0x00001f, 0x000000>};
+constexpr RowConverter convertRowXrgb1555Scalar {convertRowMasked<2, 0x007c00, 0x0003e0, 0x00001f, 0x000000>};
+constexpr RowConverter convertRowArgb1555Scalar {convertRowMasked<2, 0x007c00, 0x0003e0, 0x00001f, 0x008000>};
+
+// A2R10G10B10 and A2B10G10R10 (32bpp) to R8G8B8A8.
+constexpr RowConverter convertRowArgb2101010Scalar {convertRowMasked<4, 0x3ff00000, 0x000ffc00, 0x000003ff, 0xc0000000>};
+constexpr RowConverter convertRowAbgr2101010Scalar {convertRowMasked<4, 0x000003ff, 0x000ffc00, 0x3ff00000, 0xc0000000>};
+
+// B8G8R8 (24bpp) to R8G8B8A8; alpha is zero since the format has no alpha channel.
+constexpr RowConverter convertRowBgr24Scalar {convertRowMasked<3, 0xff0000, 0x00ff00, 0x0000ff, 0x000000>};
+
+// B8G8R8A8 (32bpp) to R8G8B8A8.
+constexpr RowConverter convertRowBgra32Scalar {convertRowMasked<4, 0xff0000, 0x00ff00, 0x0000ff, 0xff000000>};
+
+// B8G8R8X8 (32bpp) to R8G8B8A8; the unused byte is dropped and alpha is zero.
+constexpr RowConverter convertRowBgrx32Scalar {convertRowMasked<4, 0xff0000, 0x00ff00, 0x0000ff, 0x000000>};
+
+#ifdef BMP_HAS_X86_SIMD
+
+// note: the vector loops never load beyond the last pixel of the row, as the row may be the
+// last bytes of a mapped file; the remaining pixels are handled by the scalar converters.
+
+__attribute__((target("ssse3")))
+void convertRowBgr24Ssse3(const uint8_t* row, Color4* pixels, int width_px, const PixelFormat& format)
+{
+  const __m128i shuffle = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+  int j {0};
+
+  // each 16 byte load covers 4 pixels (12 bytes) so 6 pixels must remain to load safely.
+  for(; j + 6 <= width_px; j += 4){
+    __m128i bgr = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + (j * 3)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(pixels + j), _mm_shuffle_epi8(bgr, shuffle));
+  }
+  convertRowBgr24Scalar(row + (j * 3), pixels + j, width_px - j, format);
+}
+
+__attribute__((target("ssse3")))
+void convertRowBgra32Ssse3(const uint8_t* row, Color4* pixels, int width_px, const PixelFormat& format)
+{
+  const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+  int j {0};
+  for(; j + 4 <= width_px; j += 4){
+    __m128i bgra = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + (j * 4)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(pixels + j), _mm_shuffle_epi8(bgra, shuffle));
+  }
+  convertRowBgra32Scalar(row + (j * 4), pixels + j, width_px - j, format);
+}
+
+__attribute__((target("ssse3")))
+void convertRowBgrx32Ssse3(const uint8_t* row, Color4* pixels, int width_px, const PixelFormat& format)
+{
+  const __m128i shuffle = _mm_setr_epi8(2, 1, 0, -1, 6, 5, 4, -1, 10, 9, 8, -1, 14, 13, 12, -1);
+  int j {0};
+  for(; j + 4 <= width_px; j += 4){
+    __m128i bgrx = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + (j * 4)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(pixels + j), _mm_shuffle_epi8(bgrx, shuffle));
+  }
+  convertRowBgrx32Scalar(row + (j * 4), pixels + j, width_px - j, format);
+}
+
+__attribute__((target("avx2")))
+void convertRowBgr24Avx2(const uint8_t* row, Color4* pixels, int width_px, const PixelFormat& format)
+{
+  // vpshufb shuffles within 128-bit lanes so each lane is loaded with its own 4 pixels.
+  const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1,
+                                           2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+  int j {0};
+
+  // the high lane loads 16 bytes from the 12th byte so 10 pixels must remain to load safely.
+  for(; j + 10 <= width_px; j += 8){
+    const uint8_t* src {row + (j * 3)};
+    __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 12));
+    __m256i bgr = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(pixels + j), _mm256_shuffle_epi8(bgr, shuffle));
+  }
+  _mm256_zeroupper();
+  convertRowBgr24Ssse3(row + (j * 3), pixels + j, width_px - j, format);
+}
+
+__attribute__((target("avx2")))
+void convertRowBgra32Avx2(const uint8_t* row, Color4* pixels, int width_px, const PixelFormat& format)
+{
+  const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                           2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+  int j {0};
+  for(; j + 8 <= width_px; j += 8){
+    __m256i bgra = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + (j * 4)));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(pixels + j), _mm256_shuffle_epi8(bgra, shuffle));
+  }
+  _mm256_zeroupper();
+  convertRowBgra32Scalar(row + (j * 4), pixels + j, width_px - j, format);
+}
+
+__attribute__((target("avx2")))
+void convertRowBgrx32Avx2(const uint8_t* row, Color4* pixels, int width_px, const PixelFormat& format)
+{
+  const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, -1, 6, 5, 4, -1, 10, 9, 8, -1, 14, 13, 12, -1,
+                                           2, 1, 0, -1, 6, 5, 4, -1, 10, 9, 8, -1, 14, 13, 12, -1);
+  int j {0};
+  for(; j + 8 <= width_px; j += 8){
+    __m256i bgrx = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + (j * 4)));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(pixels + j), _mm256_shuffle_epi8(bgrx, shuffle));
+  }
+  _mm256_zeroupper();
+  convertRowBgrx32Scalar(row + (j * 4), pixels + j, width_px - j, format);
+}
+
+// The vector forms of scaleChannel for 16bpp pixels, in 16-bit lanes, and for channels of up
+// to 15 bits in 32bpp pixels, in 32-bit lanes.
+template<uint32_t Mask>
+__attribute__((target("ssse3")))
+__m128i scaleChannels16(__m128i rawPixels)
+{
+  constexpr ChannelScale scale {channelScales[maskWidth(Mask)]};
+  __m128i channels = _mm_srli_epi16(_mm_and_si128(rawPixels, _mm_set1_epi16(static_cast<int16_t>(Mask))), maskShift(Mask));
+  channels = _mm_add_epi16(_mm_mullo_epi16(channels, _mm_set1_epi16(scale._mul)), _mm_set1_epi16(scale._add));
+  return _mm_srli_epi16(channels, scale._shift);
+}
+
+template<uint32_t Mask>
+__attribute__((target("ssse3")))
+__m128i scaleChannels32(__m128i rawPixels)
+{
+  static_assert(maskWidth(Mask) <= 15, "channel too wide for pmaddwd");
+  constexpr ChannelScale scale {channelScales[maskWidth(Mask)]};
+  __m128i channels = _mm_srli_epi32(_mm_and_si128(rawPixels, _mm_set1_epi32(Mask)), maskShift(Mask));
+  channels = _mm_add_epi32(_mm_madd_epi16(channels, _mm_set1_epi32(scale._mul)), _mm_set1_epi32(scale._add));
+  return _mm_srli_epi32(channels, scale._shift);
+}
+
+template<uint32_t Mask>
+__attribute__((target("avx2")))
+__m256i scaleChannels16(__m256i rawPixels)
+{
+  constexpr ChannelScale scale {channelScales[maskWidth(Mask)]};
+  __m256i channels = _mm256_srli_epi16(_mm256_and_si256(rawPixels, _mm256_set1_epi16(static_cast<int16_t>(Mask))), maskShift(Mask));
+  channels = _mm256_add_epi16(_mm256_mullo_epi16(channels, _mm256_set1_epi16(scale._mul)), _mm256_set1_epi16(scale._add));
+  return _mm256_srli_epi16(channels, scale._shift);
+}
+
+template<uint32_t Mask>
+__attribute__((target("avx2")))
+__m256i scaleChannels32(__m256i rawPixels)
+{
+  static_assert(maskWidth(Mask) <= 15, "channel too wide for pmaddwd");
+  constexpr ChannelScale scale {channelScales[maskWidth(Mask)]};
+  __m256i channels = _mm256_srli_epi32(_mm256_and_si256(rawPixels, _mm256_set1_epi32(Mask)), maskShift(Mask));
+  channels = _mm256_add_epi32(_mm256_madd_epi16(channels, _mm256_set1_epi32(scale._mul)), _mm256_set1_epi32(scale._add));
+  return _mm256_srli_epi32(channels, scale._shift);
+}
+
+// 16bpp pixels are scaled in 16-bit lanes; red and green, then blue and alpha, are merged into
+// byte pairs which are interleaved into whole pixels.
+template<uint32_t RedMask, uint32_t GreenMask, uint32_t BlueMask, uint32_t AlphaMask>
+__attribute__((target("ssse3")))
+void convertRow16Ssse3(const uint8_t* row, Color4* pixels, int width_px, const PixelFormat& format)
+{
+  int j {0};
+  for(; j + 8 <= width_px; j += 8){
+    __m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + (j * 2)));
+    __m128i rg = _mm_or_si128(scaleChannels16<RedMask>(raw), _mm_slli_epi16(scaleChannels16<GreenMask>(raw), 8));
+    __m128i ba = _mm_or_si128(scaleChannels16<BlueMask>(raw), _mm_slli_epi16(scaleChannels16<AlphaMask>(raw), 8));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(pixels + j), _mm_unpacklo_epi16(rg, ba));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(pixels + j + 4), _mm_unpackhi_epi16(rg, ba));
+  }
+  convertRowMasked<2, RedMask, GreenMask, BlueMask, AlphaMask>(row + (j * 2), pixels + j, width_px - j, format);
+}
+
+template<uint32_t RedMask, uint32_t GreenMask, uint32_t BlueMask, uint32_t AlphaMask>
+__attribute__((target("avx2")))
+void convertRow16Avx2(const uint8_t* row, Color4* pixels, int width_px, const PixelFormat& format)
+{
+  int j {0};
+  for(; j + 16 <= width_px; j += 16){
+    __m256i raw = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + (j * 2)));
+    __m256i rg = _mm256_or_si256(scaleChannels16<RedMask>(raw), _mm256_slli_epi16(scaleChannels16<GreenMask>(raw), 8));
+    __m256i ba = _mm256_or_si256(scaleChannels16<BlueMask>(raw), _mm256_slli_epi16(scaleChannels16<AlphaMask>(raw), 8));
+
+    // the unpacks work within 128-bit lanes, leaving pixels 0-3 and 8-11 in lo.
+    __m256i lo = _mm256_unpacklo_epi16(rg, ba);
+    __m256i hi = _mm256_unpackhi_epi16(rg, ba);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(pixels + j), _mm256_permute2x128_si256(lo, hi, 0x20));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(pixels + j + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+  }
+  _mm256_zeroupper();
+  convertRow16Ssse3<RedMask, GreenMask, BlueMask, AlphaMask>(row + (j * 2), pixels + j, width_px - j, format);
+}
+
+// 32bpp pixels with wide channels are scaled in 32-bit lanes, then each channel is shifted to
+// its byte of the output pixel.
+template<uint32_t RedMask, uint32_t GreenMask, uint32_t BlueMask, uint32_t AlphaMask>
+__attribute__((target("ssse3")))
+void convertRow32Ssse3(const uint8_t* row, Color4* pixels, int width_px, const PixelFormat& format)
+{
+  int j {0};
+  for(; j + 4 <= width_px; j += 4){
+    __m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + (j * 4)));
+    __m128i rg = _mm_or_si128(scaleChannels32<RedMask>(raw), _mm_slli_epi32(scaleChannels32<GreenMask>(raw), 8));
+    __m128i ba = _mm_or_si128(_mm_slli_epi32(scaleChannels32<BlueMask>(raw), 16), _mm_slli_epi32(scaleChannels32<AlphaMask>(raw), 24));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(pixels + j), _mm_or_si128(rg, ba));
+  }
+  convertRowMasked<4, RedMask, GreenMask, BlueMask, AlphaMask>(row + (j * 4), pixels + j, width_px - j, format);
+}
+
+template<uint32_t RedMask, uint32_t GreenMask, uint32_t BlueMask, uint32_t AlphaMask>
+__attribute__((target("avx2")))
+void convertRow32Avx2(const uint8_t* row, Color4* pixels, int width_px, const PixelFormat& format)
+{
+  int j {0};
+  for(; j + 8 <= width_px; j += 8){
+    __m256i raw = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + (j * 4)));
+    __m256i rg = _mm256_or_si256(scaleChannels32<RedMask>(raw), _mm256_slli_epi32(scaleChannels32<GreenMask>(raw), 8));
+    __m256i ba = _mm256_or_si256(_mm256_slli_epi32(scaleChannels32<BlueMask>(raw), 16), _mm256_slli_epi32(scaleChannels32<AlphaMask>(raw), 24));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(pixels + j), _mm256_or_si256(rg, ba));
+  }
+  _mm256_zeroupper();
+  convertRow32Ssse3<RedMask, GreenMask, BlueMask, AlphaMask>(row + (j * 4), pixels + j, width_px - j, format);
+}
+
+constexpr RowConverter convertRowRgb565Ssse3 {convertRow16Ssse3<0x00f800, 0x0007e0, 0x00001f, 0x000000>};
+constexpr RowConverter convertRowXrgb1555Ssse3 {convertRow16Ssse3<0x007c00, 0x0003e0, 0x00001f, 0x000000>};
+constexpr RowConverter convertRowArgb1555Ssse3 {convertRow16Ssse3<0x007c00, 0x0003e0, 0x00001f, 0x008000>};
+constexpr RowConverter convertRowArgb2101010Ssse3 {convertRow32Ssse3<0x3ff00000, 0x000ffc00, 0x000003ff, 0xc0000000>};
+constexpr RowConverter convertRowAbgr2101010Ssse3 {convertRow32Ssse3<0x000003ff, 0x000ffc00, 0x3ff00000, 0xc0000000>};
+constexpr RowConverter convertRowRgb565Avx2 {convertRow16Avx2<0x00f800, 0x0007e0, 0x00001f, 0x000000>};
+constexpr RowConverter convertRowXrgb1555Avx2 {convertRow16Avx2<0x007c00, 0x0003e0, 0x00001f, 0x000000>};
+constexpr RowConverter convertRowArgb1555Avx2 {convertRow16Avx2<0x007c00, 0x0003e0, 0x00001f, 0x008000>};
+constexpr RowConverter convertRowArgb2101010Avx2 {convertRow32Avx2<0x3ff00000, 0x000ffc00, 0x000003ff, 0xc0000000>};
+constexpr RowConverter convertRowAbgr2101010Avx2 {convertRow32Avx2<0x000003ff, 0x000ffc00, 0x3ff00000, 0xc0000000>};
+
+#endif
+
+// Indexed row expanders map each byte of a row of 1, 2 or 4 bit indices to all the pixels it
+// holds with a single copy from a lookup table of 256 entries of 8/BitsPerIndex colors, built
+// once per image from the palette. For 8 bit indices the lookup table is the palette itself.
+using IndexedRowExpander = void (*)(const uint8_t* row, Color4* pixels, int width_px, int skip_px, const Color4* lut);
+
+template<int BitsPerIndex>
+void expandIndexedRow(const uint8_t* row, Color4* pixels, int width_px, int skip_px, const Color4* lut)
+{
+  constexpr int numPixelsPerByte {8 / BitsPerIndex};
+
+  // a region may start part way through the first byte.
+  if(skip_px > 0){
+    int numHeadPixels {std::min(numPixelsPerByte - skip_px, width_px)};
+    std::memcpy(pixels, lut + (row[0] * numPixelsPerByte) + skip_px, numHeadPixels * sizeof(Color4));
+    pixels += numHeadPixels;
+    width_px -= numHeadPixels;
+    ++row;
+  }
+
+  int numWholeBytes {width_px / numPixelsPerByte};
+  for(int i = 0; i < numWholeBytes; ++i, pixels += numPixelsPerByte)
+    std::memcpy(pixels, lut + (row[i] * numPixelsPerByte), numPixelsPerByte * sizeof(Color4));
+
+  // the last byte may hold fewer pixels than it has room for.
+  int numTailPixels {width_px % numPixelsPerByte};
+  if(numTailPixels)
+    std::memcpy(pixels, lut + (row[numWholeBytes] * numPixelsPerByte), numTailPixels * sizeof(Color4));
+}
+
+template<>
+void expandIndexedRow<8>(const uint8_t* row, Color4* pixels, int width_px, int, const Color4* lut)
+{
+  for(int j = 0; j < width_px; ++j)
+    pixels[j] = lut[row[j]];
+}
+
+// Builds the byte to pixels lookup table for an indexed image from its 256 entry palette.
+void buildIndexedLut(const std::pmr::vector<Color4>& palette, int bitsPerIndex, std::pmr::vector<Color4>& lut, BmpImage::DecodeStats& stats)
+{
+  if(bitsPerIndex == 8){
+    size_t capacity {lut.capacity()};
+    lut.assign(palette.begin(), palette.end());
+    countGrowth(lut, capacity, stats);
+    return;
+  }
+
+  int numPixelsPerByte {8 / bitsPerIndex};
+  uint8_t mask = (0x01 << bitsPerIndex) - 1;
+
+  resizeCounted(lut, 256 * numPixelsPerByte, stats);
+  for(int byte = 0; byte < 256; ++byte){
+    for(int k = 0; k < numPixelsPerByte; ++k){
+      // the left-most pixel is held in the most significant bits of the byte.
+      int shift = bitsPerIndex * (numPixelsPerByte - 1 - k);
+      lut[(byte * numPixelsPerByte) + k] = palette[(byte >> shift) & mask];
+    }
+  }
+}
+
+IndexedRowExpander selectIndexedRowExpander(int bitsPerIndex)
+{
+  switch(bitsPerIndex)
+  {
+  case 1: return expandIndexedRow<1>;
+  case 2: return expandIndexedRow<2>;
+  case 4: return expandIndexedRow<4>;
+  default: return expandIndexedRow<8>;
+  }
+}
+
+// Packs a decoded row into row rowNo of an output buffer of any format other than RGBA8.
+void packRow(const Color4* pixels, int width_px, int numRows, int rowNo, const BmpImage::OutputBuffer& output)
+{
+  uint8_t* outputRow {static_cast<uint8_t*>(output._pixels) + (static_cast<size_t>(rowNo) * output._rowStride_bytes)};
+
+  switch(output._format)
+  {
+  case BmpImage::OUTPUT_BGRA8:
+    for(int j = 0; j < width_px; ++j, outputRow += 4){
+      outputRow[0] = pixels[j].getBlue();
+      outputRow[1] = pixels[j].getGreen();
+      outputRow[2] = pixels[j].getRed();
+      outputRow[3] = pixels[j].getAlpha();
+    }
+    break;
+  case BmpImage::OUTPUT_RGB565:
+    for(int j = 0; j < width_px; ++j){
+      uint16_t rgb565 = ((pixels[j].getRed() >> 3) << 11) | ((pixels[j].getGreen() >> 2) << 5) | (pixels[j].getBlue() >> 3);
+      std::memcpy(outputRow + (j * 2), &rgb565, sizeof(rgb565));
+    }
+    break;
+  case BmpImage::OUTPUT_PLANAR8:
+  {
+    size_t planeSize_bytes {static_cast<size_t>(numRows) * output._rowStride_bytes};
+    uint8_t* red {outputRow};
+    uint8_t* green {red + planeSize_bytes};
+    uint8_t* blue {green + planeSize_bytes};
+    uint8_t* alpha {blue + planeSize_bytes};
+    for(int j = 0; j < width_px; ++j){
+      red[j] = pixels[j].getRed();
+      green[j] = pixels[j].getGreen();
+      blue[j] = pixels[j].getBlue();
+      alpha[j] = pixels[j].getAlpha();
+    }
+    break;
+  }
+  case BmpImage::OUTPUT_RGBA8:
+    std::memcpy(outputRow, pixels, width_px * sizeof(Color4));
+    break;
+  }
+}
+
+struct KnownFormat
+{
+  int _bitsPerPixel;
+  uint32_t _redMask;
+  uint32_t _greenMask;
+  uint32_t _blueMask;
+  uint32_t _alphaMask;
+  RowConverter _converters[3];   // indexed by SimdLevel; nullptr where no kernel exists.
+};
+
+const KnownFormat knownFormats[] {
+  {16, 0x00f800, 0x0007e0, 0x00001f, 0x000000,
+    {convertRowRgb565Scalar, BMP_SIMD_KERNELS(convertRowRgb565Ssse3, convertRowRgb565Avx2)}},
+  {16, 0x007c00, 0x0003e0, 0x00001f, 0x000000,
+    {convertRowXrgb1555Scalar, BMP_SIMD_KERNELS(convertRowXrgb1555Ssse3, convertRowXrgb1555Avx2)}},
+  {16, 0x007c00, 0x0003e0, 0x00001f, 0x008000,
+    {convertRowArgb1555Scalar, BMP_SIMD_KERNELS(convertRowArgb1555Ssse3, convertRowArgb1555Avx2)}},
+  {24, 0xff0000, 0x00ff00, 0x0000ff, 0x000000,
+    {convertRowBgr24Scalar, BMP_SIMD_KERNELS(convertRowBgr24Ssse3, convertRowBgr24Avx2)}},
+  {32, 0xff0000, 0x00ff00, 0x0000ff, 0x000000,
+    {convertRowBgrx32Scalar, BMP_SIMD_KERNELS(convertRowBgrx32Ssse3, convertRowBgrx32Avx2)}},
+  {32, 0xff0000, 0x00ff00, 0x0000ff, 0xff000000,
+    {convertRowBgra32Scalar, BMP_SIMD_KERNELS(convertRowBgra32Ssse3, convertRowBgra32Avx2)}},
+  {32, 0x3ff00000, 0x000ffc00, 0x000003ff, 0xc0000000,
+    {convertRowArgb2101010Scalar, BMP_SIMD_KERNELS(convertRowArgb2101010Ssse3, convertRowArgb2101010Avx2)}},
+  {32, 0x000003ff, 0x000ffc00, 0x3ff00000, 0xc0000000,
+    {convertRowAbgr2101010Scalar, BMP_SIMD_KERNELS(convertRowAbgr2101010Ssse3, convertRowAbgr2101010Avx2)}},
+};
+
+// Returns the fastest converter the cpu supports for the pixel format, falling back to the
+// generic mask converter for formats which are not well known.
+RowConverter selectRowConverter(int bitsPerPixel, const PixelFormat& format)
+{
+  for(const KnownFormat& known : knownFormats){
+    if(known._bitsPerPixel != bitsPerPixel ||
+       known._redMask != format._red._mask ||
+       known._greenMask != format._green._mask ||
+       known._blueMask != format._blue._mask ||
+       known._alphaMask != format._alpha._mask)
+    {
+      continue;
+    }
+
+    int level {getSimdLevel()};
+    while(known._converters[level] == nullptr)
+      --level;
+    return known._converters[level];
+  }
+  return convertRowGeneric;
+}
+
+// Row packers are the inverse of the row converters; they pack a row of pixels into the bytes
+// of a row of an encoded bitmap.
+using RowPacker = void (*)(const Color4* pixels, uint8_t* row, int width_px);
+
+void packRowBgr24Scalar(const Color4* pixels, uint8_t* row, int width_px)
+{
+  for(int j = 0; j < width_px; ++j, row += 3){
+    row[0] = pixels[j].getBlue();
+    row[1] = pixels[j].getGreen();
+    row[2] = pixels[j].getRed();
+  }
+}
+
+void packRowBgra32Scalar(const Color4* pixels, uint8_t* row, int width_px)
+{
+  for(int j = 0; j < width_px; ++j, row += 4){
+    row[0] = pixels[j].getBlue();
+    row[1] = pixels[j].getGreen();
+    row[2] = pixels[j].getRed();
+    row[3] = pixels[j].getAlpha();
+  }
+}
+
+void packRowRgb565(const Color4* pixels, uint8_t* row, int width_px)
+{
+  BmpImage::OutputBuffer output {row, static_cast<size_t>(width_px) * 2, width_px * 2, BmpImage::OUTPUT_RGB565};
+  packRow(pixels, width_px, 1, 0, output);
+}
+
+#ifdef BMP_HAS_X86_SIMD
+
+// note: as the converters never load beyond the end of a row, the packers never store beyond it.
+
+__attribute__((target("ssse3")))
+void packRowBgr24Ssse3(const Color4* pixels, uint8_t* row, int width_px)
+{
+  const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  int j {0};
+
+  // each 16 byte store covers 4 pixels (12 bytes) so 6 pixels must remain to store safely.
+  for(; j + 6 <= width_px; j += 4){
+    __m128i rgba = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + j));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(row + (j * 3)), _mm_shuffle_epi8(rgba, shuffle));
+  }
+  packRowBgr24Scalar(pixels + j, row + (j * 3), width_px - j);
+}
+
+__attribute__((target("ssse3")))
+void packRowBgra32Ssse3(const Color4* pixels, uint8_t* row, int width_px)
+{
+  const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+  int j {0};
+  for(; j + 4 <= width_px; j += 4){
+    __m128i rgba = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + j));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(row + (j * 4)), _mm_shuffle_epi8(rgba, shuffle));
+  }
+  packRowBgra32Scalar(pixels + j, row + (j * 4), width_px - j);
+}
+
+__attribute__((target("avx2")))
+void packRowBgr24Avx2(const Color4* pixels, uint8_t* row, int width_px)
+{
+  // vpshufb packs each 128-bit lane to 12 bytes, so each lane is stored on its own.
+  const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                           2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  int j {0};
+
+  // the high lane stores 16 bytes from the 12th byte so 10 pixels must remain to store safely.
+  for(; j + 10 <= width_px; j += 8){
+    __m256i rgba = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels + j));
+    __m256i bgr = _mm256_shuffle_epi8(rgba, shuffle);
+    uint8_t* dst {row + (j * 3)};
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm256_castsi256_si128(bgr));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 12), _mm256_extracti128_si256(bgr, 1));
+  }
+  _mm256_zeroupper();
+  packRowBgr24Ssse3(pixels + j, row + (j * 3), width_px - j);
+}
+
+__attribute__((target("avx2")))
+void packRowBgra32Avx2(const Color4* pixels, uint8_t* row, int width_px)
+{
+  const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                           2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+  int j {0};
+  for(; j + 8 <= width_px; j += 8){
+    __m256i rgba = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels + j));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(row + (j * 4)), _mm256_shuffle_epi8(rgba, shuffle));
+  }
+  _mm256_zeroupper();
+  packRowBgra32Scalar(pixels + j, row + (j * 4), width_px - j);
+}
+
+#endif
+
+// Returns the fastest packer the cpu supports for the encoding; indexed encodings have none.
+RowPacker selectRowPacker(BmpImage::EncodeFormat format)
+{
+  static const RowPacker bgr24Packers[] {packRowBgr24Scalar, BMP_SIMD_KERNELS(packRowBgr24Ssse3, packRowBgr24Avx2)};
+  static const RowPacker bgra32Packers[] {packRowBgra32Scalar, BMP_SIMD_KERNELS(packRowBgra32Ssse3, packRowBgra32Avx2)};
+
+  const RowPacker* packers {nullptr};
+  switch(format)
+  {
+  case BmpImage::ENCODE_BGR24: packers = bgr24Packers; break;
+  case BmpImage::ENCODE_BGRA32: packers = bgra32Packers; break;
+  case BmpImage::ENCODE_RGB565: return packRowRgb565;
+  case BmpImage::ENCODE_INDEXED8: return nullptr;
+  }
+
+  int level {getSimdLevel()};
+  while(packers[level] == nullptr)
+    --level;
+  return packers[level];
+}
+
+// Maps the colors of an image to their index in a palette of at most 256 colors, ignoring
+// alpha, which indexed bitmaps do not store. The open addressed table has 4 slots per color
+// so probe sequences stay short.
+class PaletteIndex
+{
+public:
+  PaletteIndex() {std::fill(std::begin(_keys), std::end(_keys), EMPTY_KEY);}
+
+  // appends the new colors of the pixels to the palette; fails if it would exceed 256 colors.
+  int add(const Color4* pixels, size_t numPixels, std::vector<Color4>& palette);
+
+  // the color must have been added.
+  uint8_t find(const Color4& color) const;
+
+private:
+  static constexpr int NUM_SLOTS {1024};
+  static constexpr uint32_t EMPTY_KEY {0xffffffff};
+
+  static uint32_t getKey(const Color4& color) {return color.getRed() | (color.getGreen() << 8) | (color.getBlue() << 16);}
+  static int getSlot(uint32_t key) {return static_cast<int>((key * 2654435761u) >> 22);}
+
+private:
+  uint32_t _keys[NUM_SLOTS];
+  uint8_t _indices[NUM_SLOTS];
+};
+
+int PaletteIndex::add(const Color4* pixels, size_t numPixels, std::vector<Color4>& palette)
+{
+  uint32_t lastKey {EMPTY_KEY};
+  for(size_t i = 0; i < numPixels; ++i){
+    uint32_t key {getKey(pixels[i])};
+    if(key == lastKey)
+      continue;
+    lastKey = key;
+
+    int slot {getSlot(key)};
+    while(_keys[slot] != EMPTY_KEY && _keys[slot] != key)
+      slot = (slot + 1) & (NUM_SLOTS - 1);
+    if(_keys[slot] == key)
+      continue;
+
+    if(palette.size() == 256)
+      return -1;
+    _keys[slot] = key;
+    _indices[slot] = static_cast<uint8_t>(palette.size());
+    palette.push_back(Color4{pixels[i].getRed(), pixels[i].getGreen(), pixels[i].getBlue(), 0});
+  }
+  return 0;
+}
+
+uint8_t PaletteIndex::find(const Color4& color) const
+{
+  uint32_t key {getKey(color)};
+  int slot {getSlot(key)};
+  while(_keys[slot] != key)
+    slot = (slot + 1) & (NUM_SLOTS - 1);
+  return _indices[slot];
+}
+
+void packRowIndexed8(const Color4* pixels, uint8_t* row, int width_px, const PaletteIndex& paletteIndex)
+{
+  for(int j = 0; j < width_px; ++j)
+    row[j] = paletteIndex.find(pixels[j]);
+}
+
+// Mip filters build a row of a mip level from the two rows of the level below it, each pixel
+// being the rounded average of a 2x2 block.
+using MipRowFilter = void (*)(const Color4* rowA, const Color4* rowB, Color4* mipRow, int width_px);
+
+Color4 averageBox(const Color4& a, const Color4& b, const Color4& c, const Color4& d)
+{
+  return Color4{
+    static_cast<uint8_t>((a.getRed() + b.getRed() + c.getRed() + d.getRed() + 2) >> 2),
+    static_cast<uint8_t>((a.getGreen() + b.getGreen() + c.getGreen() + d.getGreen() + 2) >> 2),
+    static_cast<uint8_t>((a.getBlue() + b.getBlue() + c.getBlue() + d.getBlue() + 2) >> 2),
+    static_cast<uint8_t>((a.getAlpha() + b.getAlpha() + c.getAlpha() + d.getAlpha() + 2) >> 2)
+  };
+}
+
+void filterMipRowScalar(const Color4* rowA, const Color4* rowB, Color4* mipRow, int width_px)
+{
+  for(int j = 0; j < width_px; ++j)
+    mipRow[j] = averageBox(rowA[j * 2], rowA[(j * 2) + 1], rowB[j * 2], rowB[(j * 2) + 1]);
+}
+
+#ifdef BMP_HAS_X86_SIMD
+
+__attribute__((target("ssse3")))
+void filterMipRowSsse3(const Color4* rowA, const Color4* rowB, Color4* mipRow, int width_px)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i two = _mm_set1_epi16(2);
+  int j {0};
+  for(; j + 4 <= width_px; j += 4){
+    const __m128i* a {reinterpret_cast<const __m128i*>(rowA + (j * 2))};
+    const __m128i* b {reinterpret_cast<const __m128i*>(rowB + (j * 2))};
+    __m128i a0 = _mm_loadu_si128(a);
+    __m128i a1 = _mm_loadu_si128(a + 1);
+    __m128i b0 = _mm_loadu_si128(b);
+    __m128i b1 = _mm_loadu_si128(b + 1);
+
+    // column sums in 16-bit lanes, two pixels to a register.
+    __m128i s01 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(b0, zero));
+    __m128i s23 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(b0, zero));
+    __m128i s45 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(b1, zero));
+    __m128i s67 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(b1, zero));
+
+    // the even pixels of each pair are gathered into one register and the odd into another.
+    __m128i lo = _mm_add_epi16(_mm_unpacklo_epi64(s01, s23), _mm_unpackhi_epi64(s01, s23));
+    __m128i hi = _mm_add_epi16(_mm_unpacklo_epi64(s45, s67), _mm_unpackhi_epi64(s45, s67));
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, two), 2);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, two), 2);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(mipRow + j), _mm_packus_epi16(lo, hi));
+  }
+  filterMipRowScalar(rowA + (j * 2), rowB + (j * 2), mipRow + j, width_px - j);
+}
+
+#endif
+
+// sRGB colors are averaged in linear light, as 12 bit fixed point, which is enough for every
+// color to convert to linear and back unchanged.
+struct SrgbTables
+{
+  uint16_t _toLinear[256];
+  uint8_t _fromLinear[4096];
+};
+
+const SrgbTables& getSrgbTables()
+{
+  static const SrgbTables tables = [](){
+    SrgbTables t {};
+    for(int c = 0; c < 256; ++c){
+      double s {c / 255.0};
+      double linear {(s <= 0.04045) ? s / 12.92 : std::pow((s + 0.055) / 1.055, 2.4)};
+      t._toLinear[c] = static_cast<uint16_t>(std::lround(linear * 4095.0));
+    }
+    for(int i = 0; i < 4096; ++i){
+      double linear {i / 4095.0};
+      double s {(linear <= 0.0031308) ? linear * 12.92 : (1.055 * std::pow(linear, 1.0 / 2.4)) - 0.055};
+      t._fromLinear[i] = static_cast<uint8_t>(std::clamp(std::lround(s * 255.0), 0l, 255l));
+    }
+    return t;
+  }();
+  return tables;
+}
+
+void filterMipRowSrgb(const Color4* rowA, const Color4* rowB, Color4* mipRow, int width_px)
+{
+  const SrgbTables& srgb {getSrgbTables()};
+  auto average = [&srgb](uint8_t a, uint8_t b, uint8_t c, uint8_t d){
+    int sum {srgb._toLinear[a] + srgb._toLinear[b] + srgb._toLinear[c] + srgb._toLinear[d]};
+    return srgb._fromLinear[(sum + 2) >> 2];
+  };
+
+  for(int j = 0; j < width_px; ++j){
+    const Color4& a {rowA[j * 2]};
+    const Color4& b {rowA[(j * 2) + 1]};
+    const Color4& c {rowB[j * 2]};
+    const Color4& d {rowB[(j * 2) + 1]};
+    mipRow[j] = Color4{
+      average(a.getRed(), b.getRed(), c.getRed(), d.getRed()),
+      average(a.getGreen(), b.getGreen(), c.getGreen(), d.getGreen()),
+      average(a.getBlue(), b.getBlue(), c.getBlue(), d.getBlue()),
+      static_cast<uint8_t>((a.getAlpha() + b.getAlpha() + c.getAlpha() + d.getAlpha() + 2) >> 2)
+    };
+  }
+}
+
+MipRowFilter selectMipRowFilter(BmpImage::MipFilter filter)
+{
+  if(filter == BmpImage::MIP_BOX_SRGB)
+    return filterMipRowSrgb;
+#ifdef BMP_HAS_X86_SIMD
+  if(getSimdLevel() >= SIMD_SSSE3)
+    return filterMipRowSsse3;
+#endif
+  return filterMipRowScalar;
+}
+
+} // namespace
+
+BmpMappedFile::BmpMappedFile(const std::string& filename) :
+  _bytes{nullptr},
+  _size_bytes{0}
+{
+#ifdef BMP_HAS_MMAP
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if(fd < 0)
+    return;
+
+  struct stat status;
+  if(::fstat(fd, &status) == 0 && status.st_size > 0){
+    void* addr = ::mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(addr != MAP_FAILED){
+      ::madvise(addr, status.st_size, MADV_SEQUENTIAL);
+      _bytes = static_cast<const uint8_t*>(addr);
+      _size_bytes = static_cast<size_t>(status.st_size);
+    }
+  }
+
+  // the mapping holds its own reference to the file.
+  ::close(fd);
+#endif
+}
+
+BmpMappedFile::~BmpMappedFile()
+{
+#ifdef BMP_HAS_MMAP
+  if(_bytes)
+    ::munmap(const_cast<uint8_t*>(_bytes), _size_bytes);
+#endif
+}
+
+BmpImage::BmpImage(std::pmr::memory_resource* resource) :
+  _pixels{resource},
+  _palette{resource},
+  _lut{resource},
+  _rowPixels{resource},
+  _fileBytes{resource},
+  _width_px{0},
+  _height_px{0},
+  _mipLevels{},
+  _numMipLevels{0}
+{}
+
+int BmpImage::load(const std::string& filename, LoadMode mode)
+{
+  return discardIfFailed(loadFile(filename, mode, nullptr, nullptr));
+}
+
+int BmpImage::loadFromMemory(const void* data, size_t size_bytes)
+{
+  return discardIfFailed(loadMemory(static_cast<const uint8_t*>(data), size_bytes, nullptr, nullptr));
+}
+
+int BmpImage::loadInto(const std::string& filename, const OutputBuffer& output, LoadMode mode)
+{
+  return loadFile(filename, mode, nullptr, &output);
+}
+
+int BmpImage::loadFromMemoryInto(const void* data, size_t size_bytes, const OutputBuffer& output)
+{
+  return loadMemory(static_cast<const uint8_t*>(data), size_bytes, nullptr, &output);
+}
+
+int BmpImage::loadRegion(const std::string& filename, const Region& region, LoadMode mode)
+{
+  return discardIfFailed(loadFile(filename, mode, &region, nullptr));
+}
+
+int BmpImage::loadRegionFromMemory(const void* data, size_t size_bytes, const Region& region)
+{
+  return discardIfFailed(loadMemory(static_cast<const uint8_t*>(data), size_bytes, &region, nullptr));
+}
+
+int BmpImage::loadRegionInto(const std::string& filename, const Region& region, const OutputBuffer& output, LoadMode mode)
+{
+  return loadFile(filename, mode, &region, &output);
+}
+
+int BmpImage::probe(const std::string& filename, Info& info)
+{
+  // unbuffered so the headers are fetched with a single small read.
+  std::ifstream file {};
+  file.rdbuf()->pubsetbuf(nullptr, 0);
+  file.open(filename, std::ios_base::binary);
+  if(!file){
+    return -1;
+  }
+
+  uint8_t headerBytes[MAX_HEADERS_SIZE_BYTES];
+  file.read(reinterpret_cast<char*>(headerBytes), MAX_HEADERS_SIZE_BYTES);
+  size_t numHeaderBytes = static_cast<size_t>(file.gcount());
+
+  return probeMemory(headerBytes, numHeaderBytes, info);
+}
+
+int BmpImage::probeMemory(const void* data, size_t size_bytes, Info& info)
+{
+  if(data == nullptr){
+    return -1;
+  }
+
+  FileHeader fileHead {};
+  InfoHeader infoHead {};
+  if(parseHeaders(static_cast<const uint8_t*>(data), size_bytes, fileHead, infoHead) != 0){
+    return -1;
+  }
+
+  fillInfo(fileHead, infoHead, info);
+  return 0;
+}
+
+std::vector<int> BmpImage::probe(const std::vector<std::string>& filenames, std::vector<Info>& infos)
+{
+  infos.assign(filenames.size(), Info{});
+  std::vector<int> results(filenames.size());
+  for(size_t i = 0; i < filenames.size(); ++i)
+    results[i] = probe(filenames[i], infos[i]);
+  return results;
+}
+
+int BmpImage::getOutputPixelSize_bytes(OutputFormat format)
+{
+  switch(format)
+  {
+  case OUTPUT_RGB565: return 2;
+  case OUTPUT_PLANAR8: return 1;
+  default: return 4;
+  }
+}
+
+size_t BmpImage::getOutputSize_bytes(int width_px, int height_px, int rowStride_bytes, OutputFormat format)
+{
+  if(width_px == 0 || height_px == 0)
+    return 0;
+
+  size_t numRows = std::abs(height_px);
+  if(format == OUTPUT_PLANAR8)
+    numRows *= 4;
+
+  // the last row need not be padded out to the full stride.
+  return ((numRows - 1) * rowStride_bytes) + (std::abs(width_px) * getOutputPixelSize_bytes(format));
+}
+
+int BmpImage::discardIfFailed(int result)
+{
+  // the pixels may be part overwritten; clearing them keeps their memory for the next load.
+  if(result != 0){
+    _pixels.clear();
+    _width_px = 0;
+    _height_px = 0;
+    _numMipLevels = 0;
+  }
+  return result;
+}
+
+// every load of a file or of memory passes through loadFile or loadMemory, which record its
+// stats.
+int BmpImage::loadFile(const std::string& filename, LoadMode mode, const Region* region, const OutputBuffer* output)
+{
+  StageClock clock {};
+  resetStats(_decodeStats);
+
+  int result {0};
+#ifdef BMP_HAS_MMAP
+  if(mode == LOAD_MAPPED)
+    result = loadMapped(filename, region, output);
+  else
+#endif
+    result = loadStreamed(filename, region, output);
+
+  recordLoad(_decodeStats, result, clock);
+  return result;
+}
+
+int BmpImage::loadMemory(const uint8_t* bytes, size_t size_bytes, const Region* region, const OutputBuffer* output)
+{
+  StageClock clock {};
+  resetStats(_decodeStats);
+  int result {loadBytes(bytes, size_bytes, region, output)};
+  recordLoad(_decodeStats, result, clock);
+  return result;
+}
+
+int BmpImage::loadStreamed(const std::string& filename, const Region* region, const OutputBuffer* output)
+{
+  StageClock clock {};
+
+  // an open stream is closed on return.
+  std::ifstream file {filename, std::ios_base::binary};
+  addStat(_decodeStats._numSyscalls, file ? 2 : 1);
+  clock.lap(_decodeStats._open_ns);
+  if(!file){
+    return -1;
+  }
+
+  // read as much of the headers as the largest info header could need; small files may not
+  // have this many bytes so a short read is expected and the stream state must be reset.
+  uint8_t headerBytes[MAX_HEADERS_SIZE_BYTES];
+  file.read(reinterpret_cast<char*>(headerBytes), MAX_HEADERS_SIZE_BYTES);
+  size_t numHeaderBytes = static_cast<size_t>(file.gcount());
+  file.clear();
+  addStat(_decodeStats._read_bytes, numHeaderBytes);
+  addStat(_decodeStats._numReads, 1);
+  addStat(_decodeStats._numSyscalls, 1);
+
+  FileHeader fileHead {};
+  InfoHeader infoHead {};
+  int result {parseHeaders(headerBytes, numHeaderBytes, fileHead, infoHead)};
+  clock.lap(_decodeStats._headers_ns);
+  if(result != 0){
+    return -1;
+  }
+
+  PixelSource source {&file, nullptr, 0};
+  return extract(source, fileHead, infoHead, region, output);
+}
+
+int BmpImage::loadMapped(const std::string& filename, const Region* region, const OutputBuffer* output)
+{
+  StageClock clock {};
+  BmpMappedFile mapped {filename};
+  clock.lap(_decodeStats._open_ns);
+  if(!mapped.isMapped()){
+    return -1;
+  }
+
+  // open, fstat, mmap, madvise and close, and the munmap to come.
+  addStat(_decodeStats._numSyscalls, 6);
+  return loadBytes(mapped.getBytes(), mapped.getSize(), region, output);
+}
+
+int BmpImage::loadBytes(const uint8_t* bytes, size_t size_bytes, const Region* region, const OutputBuffer* output)
+{
+  if(bytes == nullptr){
+    return -1;
+  }
+
+  StageClock clock {};
+  FileHeader fileHead {};
+  InfoHeader infoHead {};
+  int result {parseHeaders(bytes, size_bytes, fileHead, infoHead)};
+  addStat(_decodeStats._read_bytes, std::min(size_bytes, size_t{MAX_HEADERS_SIZE_BYTES}));
+  clock.lap(_decodeStats._headers_ns);
+  if(result != 0){
+    return -1;
+  }
+
+  PixelSource source {nullptr, bytes, size_bytes};
+  return extract(source, fileHead, infoHead, region, output);
+}
+
+void BmpImage::setParallelDecode(int numThreads, int minPixels)
 {
-  std::ifstream file {filename, std::ios_base::binary};
-  if(!file){
+  // the pool is made once here so loads never pay for starting threads.
+  _ownDecodePool.reset();
+  if(numThreads > 1)
+    _ownDecodePool = std::make_shared<ThreadPool>(numThreads - 1);
+  setParallelDecode(_ownDecodePool.get(), minPixels);
+}
+
+void BmpImage::setParallelDecode(ThreadPool* pool, int minPixels)
+{
+  if(pool != _ownDecodePool.get())
+    _ownDecodePool.reset();
+  _decodePool = pool;
+  _minParallelPixels = std::max(minPixels, 0);
+}
+
+void BmpImage::setMipmaps(MipFilter filter)
+{
+  _mipFilter = filter;
+}
+
+BmpImage::DecodeStats BmpImage::getTotalDecodeStats()
+{
+#ifdef BMP_STATS
+  std::lock_guard<std::mutex> lock {statsMutex};
+  return totalStats;
+#else
+  return DecodeStats{};
+#endif
+}
+
+void BmpImage::resetTotalDecodeStats()
+{
+#ifdef BMP_STATS
+  std::lock_guard<std::mutex> lock {statsMutex};
+  totalStats = DecodeStats{};
+#endif
+}
+
+std::string BmpImage::formatJson(const DecodeStats& stats)
+{
+#ifdef BMP_STATS
+  std::string json {"{\"enabled\": true"};
+#else
+  std::string json {"{\"enabled\": false"};
+#endif
+  for(const StatField& field : statFields)
+    json += ", \"" + std::string{field._name} + "\": " + std::to_string(stats.*field._field);
+  json += "}";
+  return json;
+}
+
+size_t BmpImage::layoutMipLevels(int width_px, int height_px)
+{
+  _mipLevels[0] = MipLevel{0, width_px, height_px};
+  _numMipLevels = 1;
+  size_t numPixels {static_cast<size_t>(width_px) * height_px};
+  if(_mipFilter == MIP_NONE || numPixels == 0)
+    return numPixels;
+
+  _mipRowFilter = selectMipRowFilter(_mipFilter);
+  while(width_px > 1 || height_px > 1){
+    width_px = std::max(width_px / 2, 1);
+    height_px = std::max(height_px / 2, 1);
+    _mipLevels[_numMipLevels++] = MipLevel{numPixels, width_px, height_px};
+    numPixels += static_cast<size_t>(width_px) * height_px;
+  }
+  return numPixels;
+}
+
+void BmpImage::filterMipRow(int level, int rowNo)
+{
+  const MipLevel& src {_mipLevels[level - 1]};
+  const MipLevel& dst {_mipLevels[level]};
+  const Color4* rowA {_pixels.data() + src._offset_px + (static_cast<size_t>(rowNo) * 2 * src._width_px)};
+  const Color4* rowB {(src._height_px > 1) ? rowA + src._width_px : rowA};
+  Color4* mipRow {_pixels.data() + dst._offset_px + (static_cast<size_t>(rowNo) * dst._width_px)};
+  MipRowFilter filterRow {_mipRowFilter};
+
+  // a level 1 pixel wide is only halved vertically.
+  if(src._width_px == 1){
+    Color4 a[2] {rowA[0], rowA[0]};
+    Color4 b[2] {rowB[0], rowB[0]};
+    filterRow(a, b, mipRow, 1);
+    return;
+  }
+  filterRow(rowA, rowB, mipRow, dst._width_px);
+}
+
+void BmpImage::buildMipLevels(int firstLevel)
+{
+  for(int level = firstLevel; level < _numMipLevels; ++level)
+    for(int rowNo = 0; rowNo < _mipLevels[level]._height_px; ++rowNo)
+      filterMipRow(level, rowNo);
+}
+
+int BmpImage::parseHeaders(const uint8_t* bytes, size_t size_bytes, FileHeader& fileHead, InfoHeader& infoHead)
+{
+  if(size_bytes < FILEHEADER_SIZE_BYTES + V1INFOHEADER_SIZE_BYTES){
     return -1;
   }
 
-  FileHeader fileHead {};
-  file.read(reinterpret_cast<char*>(&fileHead._fileMagic), sizeof(fileHead._fileMagic));
+  const uint8_t* cursor {bytes};
+
+  fileHead._fileMagic = readField<uint16_t>(cursor);
 
   if(fileHead._fileMagic != BMPMAGIC){
     return -1;
   }
 
-  file.read(reinterpret_cast<char*>(&fileHead._fileSize_bytes), sizeof(fileHead._fileSize_bytes));
-  file.read(reinterpret_cast<char*>(&fileHead._reserved0), sizeof(fileHead._reserved0));
-  file.read(reinterpret_cast<char*>(&fileHead._reserved1), sizeof(fileHead._reserved1));
-  file.read(reinterpret_cast<char*>(&fileHead._pixelOffset_bytes), sizeof(fileHead._pixelOffset_bytes));
+  fileHead._fileSize_bytes = readField<uint32_t>(cursor);
+  fileHead._reserved0 = readField<uint16_t>(cursor);
+  fileHead._reserved1 = readField<uint16_t>(cursor);
+  fileHead._pixelOffset_bytes = readField<uint32_t>(cursor);
 
-  InfoHeader infoHead {};
-  file.read(reinterpret_cast<char*>(&infoHead._headerSize_bytes), sizeof(infoHead._headerSize_bytes));
-  file.read(reinterpret_cast<char*>(&infoHead._bmpWidth_px), sizeof(infoHead._bmpWidth_px));
-  file.read(reinterpret_cast<char*>(&infoHead._bmpHeight_px), sizeof(infoHead._bmpHeight_px));
-  file.read(reinterpret_cast<char*>(&infoHead._numColorPlanes), sizeof(infoHead._numColorPlanes));
-  file.read(reinterpret_cast<char*>(&infoHead._bitsPerPixel), sizeof(infoHead._bitsPerPixel));
-  file.read(reinterpret_cast<char*>(&infoHead._compression), sizeof(infoHead._compression));
-  file.read(reinterpret_cast<char*>(&infoHead._imageSize_bytes), sizeof(infoHead._imageSize_bytes));
-  file.read(reinterpret_cast<char*>(&infoHead._xResolution_pxPm), sizeof(infoHead._xResolution_pxPm));
-  file.read(reinterpret_cast<char*>(&infoHead._yResolution_pxPm), sizeof(infoHead._yResolution_pxPm));
-  file.read(reinterpret_cast<char*>(&infoHead._numPaletteColors), sizeof(infoHead._numPaletteColors));
-  file.read(reinterpret_cast<char*>(&infoHead._numImportantColors), sizeof(infoHead._numImportantColors));
+  infoHead._headerSize_bytes = readField<uint32_t>(cursor);
+  infoHead._bmpWidth_px = readField<int32_t>(cursor);
+  infoHead._bmpHeight_px = readField<int32_t>(cursor);
+  infoHead._numColorPlanes = readField<uint16_t>(cursor);
+  infoHead._bitsPerPixel = readField<uint16_t>(cursor);
+  infoHead._compression = readField<uint32_t>(cursor);
+  infoHead._imageSize_bytes = readField<uint32_t>(cursor);
+  infoHead._xResolution_pxPm = readField<int32_t>(cursor);
+  infoHead._yResolution_pxPm = readField<int32_t>(cursor);
+  infoHead._numPaletteColors = readField<uint32_t>(cursor);
+  infoHead._numImportantColors = readField<uint32_t>(cursor);
+
+  if(infoHead._headerSize_bytes < V1INFOHEADER_SIZE_BYTES){
+    return -1;
+  }
+
+  // limits keep all pixel counts and file offsets within an int.
+  if(infoHead._bmpWidth_px < 0 || infoHead._bmpWidth_px > MAX_DIMENSION_PX ||
+     infoHead._bmpHeight_px < -MAX_DIMENSION_PX || infoHead._bmpHeight_px > MAX_DIMENSION_PX ||
+     static_cast<int64_t>(infoHead._bmpWidth_px) * std::abs(infoHead._bmpHeight_px) > MAX_PIXELS){
+    return -1;
+  }
+
+  // the bytes of the info header we actually read, including any masks appended to a v1 header.
+  size_t numInfoHeadBytes = std::min(infoHead._headerSize_bytes, V5INFOHEADER_SIZE_BYTES);
+  if(infoHead._headerSize_bytes == V1INFOHEADER_SIZE_BYTES && infoHead._compression == BI_BITFIELDS)
+    numInfoHeadBytes += V1MASKS_SIZE_BYTES;
+
+  if(size_bytes < FILEHEADER_SIZE_BYTES + numInfoHeadBytes){
+    return -1;
+  }
 
   int infoHeadVersion {1};
 
   if(infoHead._headerSize_bytes >= V2INFOHEADER_SIZE_BYTES ||
     (infoHead._headerSize_bytes == V1INFOHEADER_SIZE_BYTES && infoHead._compression == BI_BITFIELDS))
   {
-    file.read(reinterpret_cast<char*>(&infoHead._redMask), sizeof(infoHead._redMask));
-    file.read(reinterpret_cast<char*>(&infoHead._greenMask), sizeof(infoHead._greenMask));
-    file.read(reinterpret_cast<char*>(&infoHead._blueMask), sizeof(infoHead._blueMask));
+    infoHead._redMask = readField<uint32_t>(cursor);
+    infoHead._greenMask = readField<uint32_t>(cursor);
+    infoHead._blueMask = readField<uint32_t>(cursor);
     infoHeadVersion = 2;
   }
 
   if(infoHead._headerSize_bytes >= V3INFOHEADER_SIZE_BYTES){
-    file.read(reinterpret_cast<char*>(&infoHead._alphaMask), sizeof(infoHead._alphaMask));
+    infoHead._alphaMask = readField<uint32_t>(cursor);
     infoHeadVersion = 3;
   }
 
   if(infoHead._headerSize_bytes >= V4INFOHEADER_SIZE_BYTES){
-    file.read(reinterpret_cast<char*>(&infoHead._colorSpaceMagic), sizeof(infoHead._colorSpaceMagic));
+    infoHead._colorSpaceMagic = readField<uint32_t>(cursor);
     if(infoHead._colorSpaceMagic != SRGBMAGIC){
       return -1;
     }
@@ -70,7 +1441,14 @@ int BmpImage::load(std::string filename)
     infoHeadVersion = 5;
   }
 
-  if(infoHead._compression != BI_RGB && infoHead._compression != BI_BITFIELDS){
+  // run length encoded bitmaps must be bottom up and have the bit depth of their encoding.
+  bool isRle = (infoHead._compression == BI_RLE8 && infoHead._bitsPerPixel == 8) ||
+               (infoHead._compression == BI_RLE4 && infoHead._bitsPerPixel == 4);
+  if(isRle && infoHead._bmpHeight_px < 0){
+    return -1;
+  }
+
+  if(infoHead._compression != BI_RGB && infoHead._compression != BI_BITFIELDS && !isRle){
     return -1;
   }
 
@@ -80,7 +1458,6 @@ int BmpImage::load(std::string filename)
   case 2:
   case 4:
   case 8:
-    extractIndexedPixels(file, fileHead, infoHead);
     break;
   case 16:
     if(infoHead._compression == BI_RGB){
@@ -90,14 +1467,12 @@ int BmpImage::load(std::string filename)
       if(infoHeadVersion < 3)
         infoHead._alphaMask = 0x8000;
     }
-    extractPixels(file, fileHead, infoHead); 
     break;
   case 24:
     infoHead._redMask   = 0xff0000;      // default masks.
     infoHead._greenMask = 0x00ff00;
     infoHead._blueMask  = 0x0000ff;
     infoHead._alphaMask = 0x000000;
-    extractPixels(file, fileHead, infoHead); 
     break;
   case 32:
     if(infoHead._compression == BI_RGB){
@@ -107,148 +1482,719 @@ int BmpImage::load(std::string filename)
       if(infoHeadVersion < 3)
         infoHead._alphaMask = 0xff000000;
     }
-    extractPixels(file, fileHead, infoHead); 
     break;
+  default:
+    return -1;
   }
 
-  _width_px = infoHead._bmpWidth_px;
-  _height_px = infoHead._bmpHeight_px;
-
   return 0;
 }
 
-void BmpImage::extractIndexedPixels(std::ifstream& file, FileHeader& fileHead, InfoHeader& infoHead)
+int BmpImage::extract(PixelSource& source, FileHeader& fileHead, InfoHeader& infoHead, const Region* region, const OutputBuffer* output)
 {
-  // extract the color palette.
-  std::vector<Color4> palette {};
-  file.seekg(FILEHEADER_SIZE_BYTES + infoHead._headerSize_bytes, std::ios::beg);
-  for(uint8_t i = 0; i < infoHead._numPaletteColors; ++i){
-    char bytes[4];
-    file.read(bytes, 4);
+  Region fullImage {0, 0, infoHead._bmpWidth_px, std::abs(infoHead._bmpHeight_px)};
+  if(region == nullptr){
+    region = &fullImage;
+  }
 
-    // colors expected in the byte order blue (0), green (1), red (2), alpha (3).
-    uint8_t red = static_cast<uint8_t>(bytes[2]);
-    uint8_t green = static_cast<uint8_t>(bytes[1]);
-    uint8_t blue = static_cast<uint8_t>(bytes[0]);
-    uint8_t alpha = static_cast<uint8_t>(bytes[3]);
+  if(region->_x < 0 || region->_y < 0 || region->_w < 0 || region->_h < 0 ||
+     region->_x + region->_w > fullImage._w || region->_y + region->_h > fullImage._h)
+  {
+    return -1;
+  }
+
+  int width_px {region->_w};
+  int numRows {region->_h};
+
+  bool isRle = (infoHead._compression == BI_RLE8 || infoHead._compression == BI_RLE4);
+
+  // check the pixel array is all there before committing to decode it.
+  if(!isRle){
+    RowLayout layout {computeRowLayout(fileHead, infoHead, fullImage)};
+    int64_t pixelArraySize_bytes {static_cast<int64_t>(layout._rowSize_bytes) * layout._numRows};
+    if(fileHead._pixelOffset_bytes + pixelArraySize_bytes > getSourceSize(source, _decodeStats)){
+      return -1;
+    }
+  }
+
+  // without a caller buffer the pixels are decoded into this image, over its old pixels and
+  // followed by the mip levels, if any, in the same allocation.
+  OutputBuffer pixelsOutput {};
+  if(output == nullptr){
+    resizeCounted(_pixels, layoutMipLevels(width_px, numRows), _decodeStats);
+    pixelsOutput._pixels = _pixels.data();
+    pixelsOutput._size_bytes = static_cast<size_t>(width_px) * numRows * sizeof(Color4);
+    pixelsOutput._rowStride_bytes = width_px * sizeof(Color4);
+    pixelsOutput._format = OUTPUT_RGBA8;
+    output = &pixelsOutput;
+  }
+  else{
+    _pixels.clear();
+    _numMipLevels = 0;
+  }
 
-    palette.push_back(Color4{red, green, blue, alpha});
+  if(output->_rowStride_bytes < width_px * getOutputPixelSize_bytes(output->_format) ||
+     output->_size_bytes < getOutputSize_bytes(width_px, numRows, output->_rowStride_bytes, output->_format))
+  {
+    return -1;
   }
 
-  int rowSize_bytes = std::ceil((infoHead._bitsPerPixel * infoHead._bmpWidth_px) / 32.f) * 4.f;  
-  int numPixelsPerByte = 8 / infoHead._bitsPerPixel;
+  // the first mip level is filtered from each pair of rows as soon as they are decoded, while
+  // they are still in cache; the smaller levels are then filtered from it. A single row has no
+  // pair, so its first level is filtered after the decode.
+  bool hasMips {output == &pixelsOutput && _numMipLevels > 1};
+  _isFusingMips = (hasMips && numRows > 1);
 
-  uint8_t mask {0};
-  for(int i = 0; i < infoHead._bitsPerPixel; ++i)
-    mask |= (0x01 << i);
+  // an empty region has nothing to decode.
+  int result {0};
+  if(width_px == 0 || numRows == 0)
+    result = 0;
+  else if(isRle)
+    result = extractRlePixels(source, fileHead, infoHead, *region, *output);
+  else if(infoHead._bitsPerPixel <= 8)
+    result = extractIndexedPixels(source, fileHead, infoHead, *region, *output);
+  else
+    result = extractPixels(source, fileHead, infoHead, *region, *output);
 
-  int numRows = std::abs(infoHead._bmpHeight_px);
-  bool isTopOrigin = (infoHead._bmpHeight_px < 0);
-  int pixelOffset_bytes = static_cast<int>(fileHead._pixelOffset_bytes);
-  int rowOffset_bytes {rowSize_bytes};
-  if(isTopOrigin){
-    pixelOffset_bytes += (numRows - 1) * rowSize_bytes;
-    rowOffset_bytes *= -1;
+  bool isFusingMips {_isFusingMips};
+  _isFusingMips = false;
+
+  if(result != 0){
+    return -1;
+  }
+
+  if(hasMips){
+    StageClock clock {};
+    buildMipLevels(isFusingMips ? 2 : 1);
+    clock.lap(_decodeStats._mips_ns);
   }
 
-  _pixels.reserve(infoHead._bmpWidth_px * numRows);
+  _width_px = width_px;
+  _height_px = numRows;
 
-  int seekPos {pixelOffset_bytes};
-  char* row = new char[rowSize_bytes];
+  return 0;
+}
 
-  // for each row of pixels.
-  for(int i = 0; i < numRows; ++i){
-    file.seekg(seekPos);
-    file.read(static_cast<char*>(row), rowSize_bytes);
+int64_t BmpImage::getSourceSize(PixelSource& source, DecodeStats& stats)
+{
+  if(source._file == nullptr)
+    return static_cast<int64_t>(source._size_bytes);
 
-    // for each pixel in the row.
-    int numPixelsExtracted {0};
-    int byteNo {0};
-    int bytePixelNo {0};
-    uint8_t byte = static_cast<uint8_t>(row[byteNo]);
-    while(numPixelsExtracted < infoHead._bmpWidth_px){
-      if(bytePixelNo >= numPixelsPerByte){
-        byte = static_cast<uint8_t>(row[++byteNo]);
-        bytePixelNo = 0;
-      }
-      int shift = infoHead._bitsPerPixel * (numPixelsPerByte - 1 - bytePixelNo);
-      uint8_t index = (byte & (mask << shift)) >> shift;
-      _pixels.push_back(palette[index]);
-      ++numPixelsExtracted;
-      ++bytePixelNo;
+  source._file->seekg(0, std::ios::end);
+  int64_t size_bytes {source._file->tellg()};
+  addStat(stats._numSeeks, 2);
+  addStat(stats._numSyscalls, 2);
+  return std::max(size_bytes, int64_t{0});
+}
+
+// fetches are counted in the stats, if given; a fetch from a stream is a seek and a read.
+const uint8_t* BmpImage::fetchBytes(PixelSource& source, size_t offset, size_t size, char* scratch, DecodeStats* stats)
+{
+  if(source._file){
+    if(stats){
+      addStat(stats->_numSeeks, 1);
+      addStat(stats->_numReads, 1);
+      addStat(stats->_numSyscalls, 2);
     }
-    seekPos += rowOffset_bytes;
+    source._file->seekg(offset);
+    if(!source._file->read(scratch, size))
+      return nullptr;
+    if(stats)
+      addStat(stats->_read_bytes, size);
+    return reinterpret_cast<const uint8_t*>(scratch);
   }
-  delete[] row;
+
+  if(offset > source._size_bytes || size > source._size_bytes - offset)
+    return nullptr;
+  if(stats)
+    addStat(stats->_read_bytes, size);
+  return source._bytes + offset;
 }
 
-void BmpImage::extractPixels(std::ifstream& file, FileHeader& fileHead, InfoHeader& infoHead)
+uint32_t BmpImage::getNumPaletteColors(const InfoHeader& infoHead)
 {
-  // note: this function handles 16-bit, 24-bit and 32-bit pixels.
+  if(infoHead._bitsPerPixel > 8)
+    return 0;
+
+  // a palette size of 0 means the palette holds the default 2^bpp colors.
+  uint32_t numPaletteColors {infoHead._numPaletteColors};
+  if(numPaletteColors == 0 || numPaletteColors > MAX_PALETTE_COLORS)
+    numPaletteColors = std::min(uint32_t{0x01} << infoHead._bitsPerPixel, MAX_PALETTE_COLORS);
+  return numPaletteColors;
+}
+
+void BmpImage::fillInfo(const FileHeader& fileHead, const InfoHeader& infoHead, Info& info)
+{
+  info._width_px = infoHead._bmpWidth_px;
+  info._height_px = std::abs(infoHead._bmpHeight_px);
+  info._bitsPerPixel = infoHead._bitsPerPixel;
+  info._compression = infoHead._compression;
+  info._redMask = infoHead._redMask;
+  info._greenMask = infoHead._greenMask;
+  info._blueMask = infoHead._blueMask;
+  info._alphaMask = infoHead._alphaMask;
+  info._numPaletteColors = getNumPaletteColors(infoHead);
+  info._isTopOrigin = (infoHead._bmpHeight_px < 0);
+  info._pixelOffset_bytes = fileHead._pixelOffset_bytes;
+}
 
+BmpImage::RowLayout BmpImage::computeRowLayout(const FileHeader& fileHead, const InfoHeader& infoHead, const Region& region)
+{
   // If bitmap height is negative the origin is in top-left corner in the file so the first
   // row in the file is the top row of the image. This class always places the origin in the
-  // bottom left so in this case we want to read the last row in the file first to reorder the 
+  // bottom left so in this case we want to read the last row in the file first to reorder the
   // in-memory pixels. If the bitmap height is positive then we can simply read the first row
   // in the file first, as this will be the first row in the in-memory bitmap.
-  
-  int rowSize_bytes = std::ceil((infoHead._bitsPerPixel * infoHead._bmpWidth_px) / 32.f) * 4.f;  
-  int pixelSize_bytes = infoHead._bitsPerPixel / 8;
 
-  int numRows = std::abs(infoHead._bmpHeight_px);
+  int numImageRows {std::abs(infoHead._bmpHeight_px)};
+
+  RowLayout layout {};
+  layout._width_px = region._w;
+  layout._numRows = region._h;
+  layout._rowSize_bytes = std::ceil((infoHead._bitsPerPixel * infoHead._bmpWidth_px) / 32.f) * 4.f;
+  layout._firstRowOffset_bytes = static_cast<int>(fileHead._pixelOffset_bytes);
+  layout._rowStep_bytes = layout._rowSize_bytes;
+
   bool isTopOrigin = (infoHead._bmpHeight_px < 0);
-  int pixelOffset_bytes = static_cast<int>(fileHead._pixelOffset_bytes);
-  int rowOffset_bytes {rowSize_bytes};
   if(isTopOrigin){
-    pixelOffset_bytes += (numRows - 1) * rowSize_bytes;
-    rowOffset_bytes *= -1;
+    layout._firstRowOffset_bytes += (numImageRows - 1) * layout._rowSize_bytes;
+    layout._rowStep_bytes *= -1;
+  }
+
+  // only the bytes holding the columns of the region are fetched from each of its rows; with
+  // indices of less than 8 bits the first column may lie part way through a byte.
+  int firstBit {region._x * infoHead._bitsPerPixel};
+  int endBit {(region._x + region._w) * infoHead._bitsPerPixel};
+  int firstByte {firstBit / 8};
+  layout._firstRowOffset_bytes += (region._y * layout._rowStep_bytes) + firstByte;
+  layout._rowFetch_bytes = ((endBit + 7) / 8) - firstByte;
+  layout._skip_px = (firstBit % 8) / infoHead._bitsPerPixel;
+
+  return layout;
+}
+
+// Decodes every row of the layout into its final place in the output buffer with
+// decodeRow(const uint8_t* row, Color4* rowPixels).
+template<typename DecodeRow>
+int BmpImage::decodeRows(PixelSource& source, const RowLayout& layout, const OutputBuffer& output, DecodeRow decodeRow)
+{
+  if(layout._numRows == 0)
+    return 0;
+
+  // a band for the loading thread and one for each worker of the pool.
+  int numPixels {layout._width_px * layout._numRows};
+  int numThreads {1};
+  if(_decodePool && !source._file && numPixels >= _minParallelPixels)
+    numThreads = std::min(_decodePool->getNumThreads() + 1, layout._numRows);
+
+  // each band of rows is decoded by a single thread; rows are decoded straight into the output
+  // when it is RGBA8, otherwise via a row of scratch pixels per band which is then packed. Only
+  // streams, which are never split, need a row of scratch bytes.
+  resizeCounted(_fileBytes, source._file ? layout._rowFetch_bytes : 0, _decodeStats);
+  resizeCounted(_rowPixels, output._format == OUTPUT_RGBA8 ? 0 : static_cast<size_t>(layout._width_px) * numThreads, _decodeStats);
+
+  // each band adds to its own stats, so the threads never share them.
+  auto decodeBand = [this, &source, &layout, &output, &decodeRow](int firstRow, int endRow, Color4* pixelScratch, DecodeStats& stats){
+    uint8_t* outputBytes {static_cast<uint8_t*>(output._pixels)};
+    StageClock clock {};
+
+    int seekPos {layout._firstRowOffset_bytes + (firstRow * layout._rowStep_bytes)};
+
+    // for each row of pixels.
+    for(int i = firstRow; i < endRow; ++i){
+      const uint8_t* row = fetchBytes(source, seekPos, layout._rowFetch_bytes, _fileBytes.data(), &stats);
+      clock.lap(stats._read_ns);
+      if(row == nullptr){
+        return -1;
+      }
+
+      if(output._format == OUTPUT_RGBA8){
+        Color4* rowPixels {reinterpret_cast<Color4*>(outputBytes + (static_cast<size_t>(i) * output._rowStride_bytes))};
+        decodeRow(row, rowPixels);
+        if(_isFusingMips && (i & 0x01))
+          filterMipRow(1, i / 2);
+      }
+      else{
+        decodeRow(row, pixelScratch);
+        packRow(pixelScratch, layout._width_px, layout._numRows, i, output);
+      }
+      clock.lap(stats._convert_ns);
+
+      seekPos += layout._rowStep_bytes;
+    }
+
+    return 0;
+  };
+
+  if(numThreads <= 1)
+    return decodeBand(0, layout._numRows, _rowPixels.data(), _decodeStats);
+
+  // rows are contiguous in the file so checking the rows at either end checks them all, after
+  // which the workers cannot fail.
+  int lastRowOffset_bytes {layout._firstRowOffset_bytes + ((layout._numRows - 1) * layout._rowStep_bytes)};
+  if(fetchBytes(source, layout._firstRowOffset_bytes, layout._rowFetch_bytes, nullptr, nullptr) == nullptr ||
+     fetchBytes(source, lastRowOffset_bytes, layout._rowFetch_bytes, nullptr, nullptr) == nullptr)
+  {
+    return -1;
+  }
+
+  // bands start on even rows when fusing mips so each pair of rows is decoded by one thread.
+  auto getBandStart = [this, &layout, numThreads](int t){
+    int firstRow {(layout._numRows * t) / numThreads};
+    return (_isFusingMips && t < numThreads) ? (firstRow & ~0x01) : firstRow;
+  };
+
+  // the calling thread takes the first band and the pool the rest. Only the bands are waited
+  // on, not the whole pool, as the pool may be running other loads, this one included. Tasks
+  // capture no more than a band number, so they fit in a Task without allocating.
+  std::atomic<int> numBandsLeft {numThreads};
+  auto decodeWorkerBand = [this, &decodeBand, &layout, &getBandStart, &numBandsLeft](int t){
+    Color4* pixelScratch {_rowPixels.empty() ? nullptr : _rowPixels.data() + (static_cast<size_t>(layout._width_px) * t)};
+    DecodeStats bandStats {};
+    decodeBand(getBandStart(t), getBandStart(t + 1), pixelScratch, bandStats);
+    addStats(_decodeStats, bandStats);
+    --numBandsLeft;
+  };
+  for(int t = 1; t < numThreads; ++t)
+    _decodePool->submit([&decodeWorkerBand, t](){decodeWorkerBand(t);});
+  decodeWorkerBand(0);
+  _decodePool->wait(numBandsLeft);
+
+  return 0;
+}
+
+int BmpImage::readPalette(PixelSource& source, InfoHeader& infoHead)
+{
+  uint32_t numPaletteColors {getNumPaletteColors(infoHead)};
+
+  // extract the color palette.
+  size_t paletteSize_bytes = numPaletteColors * 4;
+  resizeCounted(_fileBytes, source._file ? paletteSize_bytes : 0, _decodeStats);
+  const uint8_t* paletteBytes = fetchBytes(source, FILEHEADER_SIZE_BYTES + infoHead._headerSize_bytes,
+                                           paletteSize_bytes, _fileBytes.data(), &_decodeStats);
+  if(paletteBytes == nullptr){
+    return -1;
+  }
+
+  // the palette is padded to the full 256 colors so corrupt indices cannot read beyond it.
+  size_t capacity {_palette.capacity()};
+  _palette.assign(MAX_PALETTE_COLORS, Color4{});
+  countGrowth(_palette, capacity, _decodeStats);
+  for(uint32_t i = 0; i < numPaletteColors; ++i){
+    const uint8_t* bytes {paletteBytes + (i * 4)};
+
+    // colors expected in the byte order blue (0), green (1), red (2), alpha (3).
+    uint8_t red = bytes[2];
+    uint8_t green = bytes[1];
+    uint8_t blue = bytes[0];
+    uint8_t alpha = bytes[3];
+
+    _palette[i] = Color4{red, green, blue, alpha};
+  }
+
+  return 0;
+}
+
+int BmpImage::extractIndexedPixels(PixelSource& source, FileHeader& fileHead, InfoHeader& infoHead, const Region& region, const OutputBuffer& output)
+{
+  StageClock clock {};
+  if(readPalette(source, infoHead) != 0){
+    return -1;
   }
 
+  buildIndexedLut(_palette, infoHead._bitsPerPixel, _lut, _decodeStats);
+  const Color4* lut {_lut.data()};
+  IndexedRowExpander expandRow = selectIndexedRowExpander(infoHead._bitsPerPixel);
+  clock.lap(_decodeStats._palette_ns);
+
+  RowLayout layout {computeRowLayout(fileHead, infoHead, region)};
+
+  return decodeRows(source, layout, output, [lut, &expandRow, &layout](const uint8_t* row, Color4* rowPixels){
+    expandRow(row, rowPixels, layout._width_px, layout._skip_px, lut);
+  });
+}
+
+int BmpImage::extractPixels(PixelSource& source, FileHeader& fileHead, InfoHeader& infoHead, const Region& region, const OutputBuffer& output)
+{
+  // note: this function handles 16-bit, 24-bit and 32-bit pixels.
+
+  StageClock clock {};
+
   // shift values are needed when using channel masks to extract color channel data from
-  // the raw pixel bytes.
-  int redShift {0};
-  int greenShift {0};
-  int blueShift {0};
-  int alphaShift {0};
-
-  while((infoHead._redMask & (0x01 << redShift)) == 0) ++redShift;
-  while((infoHead._greenMask & (0x01 << greenShift)) == 0) ++greenShift;
-  while((infoHead._blueMask & (0x01 << blueShift)) == 0) ++blueShift;
-  if(infoHead._alphaMask)
-    while((infoHead._alphaMask & (0x01 << alphaShift)) == 0) ++alphaShift;
-
-  _pixels.reserve(infoHead._bmpWidth_px * numRows);
-
-  int seekPos {pixelOffset_bytes};
-  char* row = new char[rowSize_bytes];
-
-  // for each row of pixels.
-  for(int i = 0; i < numRows; ++i){
-    file.seekg(seekPos);
-    file.read(static_cast<char*>(row), rowSize_bytes);
-
-    // for each pixel.
-    for(int j = 0; j < infoHead._bmpWidth_px; ++j){
-      uint32_t rawPixelBytes {0};
-
-      // for each pixel byte.
-      for(int k = 0; k < pixelSize_bytes; ++k){
-        uint8_t pixelByte = row[(j * pixelSize_bytes) + k];
-
-        // 0rth byte of pixel stored in LSB of rawPixelBytes.
-        rawPixelBytes |= static_cast<uint32_t>(pixelByte << (k * 8));
+  // the raw pixel bytes. The format is left uninitialized as its lookup tables are large and
+  // only filled for the generic converter.
+  PixelFormat format;
+  format._bytesPerPixel = infoHead._bitsPerPixel / 8;
+  buildChannel(infoHead._redMask, false, format._red);
+  buildChannel(infoHead._greenMask, false, format._green);
+  buildChannel(infoHead._blueMask, false, format._blue);
+  buildChannel(infoHead._alphaMask, false, format._alpha);
+
+  // the converter is chosen once here so the row loop makes no per-pixel format decisions.
+  RowConverter convertRow = selectRowConverter(infoHead._bitsPerPixel, format);
+  if(convertRow == convertRowGeneric){
+    for(Channel* channel : {&format._red, &format._green, &format._blue, &format._alpha})
+      buildChannel(channel->_mask, true, *channel);
+  }
+  clock.lap(_decodeStats._convert_ns);
+
+  RowLayout layout {computeRowLayout(fileHead, infoHead, region)};
+
+  return decodeRows(source, layout, output, [&format, &convertRow, &layout](const uint8_t* row, Color4* rowPixels){
+    convertRow(row, rowPixels, layout._width_px, format);
+  });
+}
+
+int BmpImage::extractRlePixels(PixelSource& source, FileHeader& fileHead, InfoHeader& infoHead, const Region& region, const OutputBuffer& output)
+{
+  // note: this function handles RLE8 and RLE4 compressed pixels, which are always stored with
+  // the bottom row first.
+
+  StageClock clock {};
+  if(readPalette(source, infoHead) != 0){
+    return -1;
+  }
+  const Color4* palette {_palette.data()};
+  clock.lap(_decodeStats._palette_ns);
+
+  // the encoded pixels cannot be addressed by row so they are fetched in a single block. The
+  // header's size (which may be 0, meaning unknown) is clamped to the bytes actually there, so
+  // a corrupt size cannot ask for a huge block; data which ends early is rejected below.
+  int64_t sourceSize_bytes {getSourceSize(source, _decodeStats)};
+  if(sourceSize_bytes < fileHead._pixelOffset_bytes){
+    return -1;
+  }
+  size_t dataSize_bytes {static_cast<size_t>(sourceSize_bytes - fileHead._pixelOffset_bytes)};
+  if(infoHead._imageSize_bytes != 0)
+    dataSize_bytes = std::min(dataSize_bytes, size_t{infoHead._imageSize_bytes});
+
+  resizeCounted(_fileBytes, source._file ? dataSize_bytes : 0, _decodeStats);
+  const uint8_t* data = fetchBytes(source, fileHead._pixelOffset_bytes, dataSize_bytes, _fileBytes.data(), &_decodeStats);
+  clock.lap(_decodeStats._read_ns);
+  if(data == nullptr){
+    return -1;
+  }
+
+  int width_px {infoHead._bmpWidth_px};
+  bool isRle4 {infoHead._compression == BI_RLE4};
+
+  // Each row is built in a scratch row and written out once complete, as the encoding may
+  // skip pixels (and whole rows) with end of line and delta escapes; skipped pixels are left
+  // transparent black. Runs are written with bulk fills.
+  size_t capacity {_rowPixels.capacity()};
+  _rowPixels.assign(width_px, Color4{});
+  countGrowth(_rowPixels, capacity, _decodeStats);
+  Color4* rowPixels {_rowPixels.data()};
+  int rowNo {0};
+  int col {0};
+
+  // every row must be decoded to find the next but only those in the region are written out.
+  int endRow {region._y + region._h};
+  auto finishRow = [&](){
+    if(rowNo >= region._y){
+      packRow(rowPixels + region._x, region._w, region._h, rowNo - region._y, output);
+      if(_isFusingMips && ((rowNo - region._y) & 0x01))
+        filterMipRow(1, (rowNo - region._y) / 2);
+    }
+    std::fill_n(rowPixels, width_px, Color4{});
+    ++rowNo;
+    col = 0;
+  };
+
+  const uint8_t* cursor {data};
+  const uint8_t* end {data + dataSize_bytes};
+
+  while(rowNo < endRow && end - cursor >= 2){
+    uint8_t count {cursor[0]};
+    uint8_t value {cursor[1]};
+    cursor += 2;
+
+    // encoded mode; a run of count pixels of one index (or two alternating indices in RLE4).
+    if(count > 0){
+      int numPixels {std::min<int>(count, width_px - col)};
+      Color4* run {rowPixels + col};
+      if(!isRle4 || (value >> 4) == (value & 0x0f)){
+        std::fill_n(run, numPixels, palette[isRle4 ? (value & 0x0f) : value]);
+      }
+      else{
+        Color4 colors[2] {palette[value >> 4], palette[value & 0x0f]};
+        for(int k = 0; k < numPixels; ++k)
+          run[k] = colors[k & 0x01];
+      }
+      col += numPixels;
+      continue;
+    }
+
+    switch(value)
+    {
+    case RLE_END_OF_LINE:
+      finishRow();
+      break;
+
+    case RLE_END_OF_BITMAP:
+      while(rowNo < endRow)
+        finishRow();
+      clock.lap(_decodeStats._convert_ns);
+      return 0;
+
+    case RLE_DELTA:
+    {
+      if(end - cursor < 2){
+        return -1;
+      }
+      int newCol {col + cursor[0]};
+      int numRowsSkipped {cursor[1]};
+      cursor += 2;
+      for(int k = 0; k < numRowsSkipped && rowNo < endRow; ++k)
+        finishRow();
+      col = std::min(newCol, width_px);
+      break;
+    }
+
+    // absolute mode; value literal indices follow, padded to a 16-bit boundary.
+    default:
+    {
+      int numPixels {value};
+      int numBytes {isRle4 ? (numPixels + 1) / 2 : numPixels};
+      int numPaddedBytes {(numBytes + 1) & ~0x01};
+      if(end - cursor < numPaddedBytes){
+        return -1;
       }
+      int numWritten {std::min(numPixels, width_px - col)};
+      Color4* literals {rowPixels + col};
+      for(int k = 0; k < numWritten; ++k){
+        uint8_t index {isRle4 ? static_cast<uint8_t>((k & 0x01) ? (cursor[k / 2] & 0x0f) : (cursor[k / 2] >> 4)) : cursor[k]};
+        literals[k] = palette[index];
+      }
+      col += numWritten;
+      cursor += numPaddedBytes;
+      break;
+    }
+    }
+  }
+
+  // the data ran out before an end of bitmap escape, or before the last row of the region;
+  // as for uncompressed pixels, truncated data is an error.
+  clock.lap(_decodeStats._convert_ns);
+  if(rowNo < endRow){
+    return -1;
+  }
+
+  return 0;
+}
+
+int BmpImage::encode(const Color4* pixels, int width_px, int height_px, const EncodeOptions& options, std::vector<uint8_t>& bytes)
+{
+  bytes.clear();
+  if(width_px > 0 && height_px > 0)
+    bytes.reserve(getEncodedSize_bytes(width_px, height_px, options._format));
+
+  return encodeTo(pixels, width_px, height_px, options, [&bytes](const uint8_t* batch, size_t size_bytes){
+    bytes.insert(bytes.end(), batch, batch + size_bytes);
+    return 0;
+  });
+}
 
-      uint8_t red = (rawPixelBytes & infoHead._redMask) >> redShift;
-      uint8_t green = (rawPixelBytes & infoHead._greenMask) >> greenShift;
-      uint8_t blue = (rawPixelBytes & infoHead._blueMask) >> blueShift;
-      uint8_t alpha = (rawPixelBytes & infoHead._alphaMask) >> alphaShift;
+int BmpImage::save(const std::string& filename, const Color4* pixels, int width_px, int height_px, const EncodeOptions& options)
+{
+  std::ofstream file {filename, std::ios::binary | std::ios::trunc};
+  if(!file){
+    return -1;
+  }
+
+  // the batches are larger than the stream's buffer so each is written with a single call.
+  return encodeTo(pixels, width_px, height_px, options, [&file](const uint8_t* batch, size_t size_bytes){
+    file.write(reinterpret_cast<const char*>(batch), size_bytes);
+    return file ? 0 : -1;
+  });
+}
+
+int BmpImage::save(const std::string& filename, const EncodeOptions& options) const
+{
+  // an image last loaded into a caller's buffer has a size but no pixels; the mip levels, if
+  // any, follow the image's pixels.
+  if(_pixels.size() < static_cast<size_t>(_width_px) * _height_px || _numMipLevels == 0){
+    return -1;
+  }
+  return save(filename, _pixels.data(), _width_px, _height_px, options);
+}
+
+size_t BmpImage::getEncodedSize_bytes(int width_px, int height_px, EncodeFormat format)
+{
+  if(width_px <= 0 || height_px <= 0){
+    return 0;
+  }
+
+  FileHeader fileHead {};
+  InfoHeader infoHead {};
+  makeHeaders(width_px, height_px, EncodeOptions{format, false}, (format == ENCODE_INDEXED8) ? MAX_PALETTE_COLORS : 0, fileHead, infoHead);
+  return fileHead._fileSize_bytes;
+}
+
+// Encodes the headers, palette and rows of a bitmap into a batch buffer, passing each full
+// batch to write(const uint8_t* batch, size_t size_bytes), which returns 0 on success.
+template<typename Write>
+int BmpImage::encodeTo(const Color4* pixels, int width_px, int height_px, const EncodeOptions& options, Write write)
+{
+  if(pixels == nullptr || width_px <= 0 || height_px <= 0 ||
+     width_px > MAX_DIMENSION_PX || height_px > MAX_DIMENSION_PX ||
+     static_cast<int64_t>(width_px) * height_px > MAX_PIXELS)
+  {
+    return -1;
+  }
+
+  // an indexed bitmap needs every color of the image before its first row can be packed.
+  std::vector<Color4> palette {};
+  std::unique_ptr<PaletteIndex> paletteIndex {};
+  if(options._format == ENCODE_INDEXED8){
+    paletteIndex = std::make_unique<PaletteIndex>();
+    if(paletteIndex->add(pixels, static_cast<size_t>(width_px) * height_px, palette) != 0){
+      return -1;
+    }
+  }
+
+  FileHeader fileHead {};
+  InfoHeader infoHead {};
+  makeHeaders(width_px, height_px, options, static_cast<int>(palette.size()), fileHead, infoHead);
+
+  size_t rowSize_bytes {infoHead._imageSize_bytes / height_px};
+  size_t packedSize_bytes {static_cast<size_t>(width_px) * (infoHead._bitsPerPixel / 8)};
+  int numBatchRows {static_cast<int>(std::max(ENCODE_BATCH_SIZE_BYTES / rowSize_bytes, size_t{1}))};
+  std::vector<uint8_t> batch(std::max(numBatchRows * rowSize_bytes, static_cast<size_t>(fileHead._pixelOffset_bytes)));
 
-      _pixels.push_back(Color4{red, green, blue, alpha});
+  uint8_t* cursor {writeHeaders(fileHead, infoHead, batch.data())};
+  for(const Color4& color : palette){
+    writeField<uint8_t>(cursor, color.getBlue());
+    writeField<uint8_t>(cursor, color.getGreen());
+    writeField<uint8_t>(cursor, color.getRed());
+    writeField<uint8_t>(cursor, 0);
+  }
+  if(write(batch.data(), fileHead._pixelOffset_bytes) != 0){
+    return -1;
+  }
+
+  // indexed rows have no packer; they are looked up in the palette index instead.
+  RowPacker packPixels {selectRowPacker(options._format)};
+
+  // rows are written in the order they are stored; the header's height sign tells readers
+  // which order that is.
+  for(int row = 0; row < height_px; row += numBatchRows){
+    int numRows {std::min(numBatchRows, height_px - row)};
+    for(int i = 0; i < numRows; ++i){
+      const Color4* rowPixels {pixels + (static_cast<size_t>(row + i) * width_px)};
+      uint8_t* rowBytes {batch.data() + (i * rowSize_bytes)};
+      if(paletteIndex)
+        packRowIndexed8(rowPixels, rowBytes, width_px, *paletteIndex);
+      else
+        packPixels(rowPixels, rowBytes, width_px);
+      std::memset(rowBytes + packedSize_bytes, 0, rowSize_bytes - packedSize_bytes);
+    }
+    if(write(batch.data(), numRows * rowSize_bytes) != 0){
+      return -1;
     }
-    seekPos += rowOffset_bytes;
   }
-  delete[] row;
+
+  return 0;
+}
+
+void BmpImage::makeHeaders(int width_px, int height_px, const EncodeOptions& options, int numPaletteColors, FileHeader& fileHead, InfoHeader& infoHead)
+{
+  infoHead._headerSize_bytes = V1INFOHEADER_SIZE_BYTES;
+  infoHead._bmpWidth_px = width_px;
+  infoHead._bmpHeight_px = options._isTopOrigin ? -height_px : height_px;
+  infoHead._numColorPlanes = 1;
+  infoHead._compression = BI_RGB;
+  infoHead._xResolution_pxPm = ENCODE_RESOLUTION_PXPM;
+  infoHead._yResolution_pxPm = ENCODE_RESOLUTION_PXPM;
+  infoHead._numPaletteColors = 0;
+  infoHead._numImportantColors = 0;
+  infoHead._redMask = 0;
+  infoHead._greenMask = 0;
+  infoHead._blueMask = 0;
+  infoHead._alphaMask = 0;
+  infoHead._colorSpaceMagic = 0;
+
+  uint32_t masksSize_bytes {0};
+
+  switch(options._format)
+  {
+  case ENCODE_BGR24:
+    infoHead._bitsPerPixel = 24;
+    break;
+  case ENCODE_BGRA32:
+    // the alpha mask needs at least a v3 header; v4 is the first widely supported.
+    infoHead._headerSize_bytes = V4INFOHEADER_SIZE_BYTES;
+    infoHead._bitsPerPixel = 32;
+    infoHead._compression = BI_BITFIELDS;
+    infoHead._redMask   = 0x00ff0000;
+    infoHead._greenMask = 0x0000ff00;
+    infoHead._blueMask  = 0x000000ff;
+    infoHead._alphaMask = 0xff000000;
+    infoHead._colorSpaceMagic = SRGBMAGIC;
+    break;
+  case ENCODE_RGB565:
+    infoHead._bitsPerPixel = 16;
+    infoHead._compression = BI_BITFIELDS;
+    infoHead._redMask   = 0xf800;
+    infoHead._greenMask = 0x07e0;
+    infoHead._blueMask  = 0x001f;
+    masksSize_bytes = V1MASKS_SIZE_BYTES;
+    break;
+  case ENCODE_INDEXED8:
+    infoHead._bitsPerPixel = 8;
+    infoHead._numPaletteColors = numPaletteColors;
+    break;
+  }
+
+  uint32_t rowSize_bytes {((static_cast<uint32_t>(width_px) * infoHead._bitsPerPixel + 31) / 32) * 4};
+  infoHead._imageSize_bytes = rowSize_bytes * height_px;
+
+  fileHead._fileMagic = BMPMAGIC;
+  fileHead._reserved0 = 0;
+  fileHead._reserved1 = 0;
+  fileHead._pixelOffset_bytes = FILEHEADER_SIZE_BYTES + infoHead._headerSize_bytes + masksSize_bytes + (numPaletteColors * 4);
+  fileHead._fileSize_bytes = fileHead._pixelOffset_bytes + infoHead._imageSize_bytes;
 }
 
+// Writes the headers as parseHeaders reads them and returns the end of the written bytes.
+uint8_t* BmpImage::writeHeaders(const FileHeader& fileHead, const InfoHeader& infoHead, uint8_t* bytes)
+{
+  uint8_t* cursor {bytes};
+
+  writeField<uint16_t>(cursor, fileHead._fileMagic);
+  writeField<uint32_t>(cursor, fileHead._fileSize_bytes);
+  writeField<uint16_t>(cursor, fileHead._reserved0);
+  writeField<uint16_t>(cursor, fileHead._reserved1);
+  writeField<uint32_t>(cursor, fileHead._pixelOffset_bytes);
 
+  writeField<uint32_t>(cursor, infoHead._headerSize_bytes);
+  writeField<int32_t>(cursor, infoHead._bmpWidth_px);
+  writeField<int32_t>(cursor, infoHead._bmpHeight_px);
+  writeField<uint16_t>(cursor, infoHead._numColorPlanes);
+  writeField<uint16_t>(cursor, infoHead._bitsPerPixel);
+  writeField<uint32_t>(cursor, infoHead._compression);
+  writeField<uint32_t>(cursor, infoHead._imageSize_bytes);
+  writeField<int32_t>(cursor, infoHead._xResolution_pxPm);
+  writeField<int32_t>(cursor, infoHead._yResolution_pxPm);
+  writeField<uint32_t>(cursor, infoHead._numPaletteColors);
+  writeField<uint32_t>(cursor, infoHead._numImportantColors);
+
+  // in a v1 header the masks follow it; in later versions they are part of it.
+  if(infoHead._compression == BI_BITFIELDS){
+    writeField<uint32_t>(cursor, infoHead._redMask);
+    writeField<uint32_t>(cursor, infoHead._greenMask);
+    writeField<uint32_t>(cursor, infoHead._blueMask);
+  }
+
+  if(infoHead._headerSize_bytes >= V4INFOHEADER_SIZE_BYTES){
+    writeField<uint32_t>(cursor, infoHead._alphaMask);
+    writeField<uint32_t>(cursor, infoHead._colorSpaceMagic);
+
+    // the endpoints and gammas are unused with the srgb color space.
+    size_t numUnusedBytes {V4INFOHEADER_SIZE_BYTES - V3INFOHEADER_SIZE_BYTES - sizeof(uint32_t)};
+    std::memset(cursor, 0, numUnusedBytes);
+    cursor += numUnusedBytes;
+  }
+
+  return cursor;
+}
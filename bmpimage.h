@@ -6,28 +6,108 @@
 // AUTHOR: Ian Murfin - github.com/ianmurfinxyz                                                 //
 //----------------------------------------------------------------------------------------------//
 
+#include <cinttypes>
+#include <cstddef>
+#include <string>
+#include <vector>
 #include <fstream>
+#include <memory>
+#include <memory_resource>
 #include "color.h"
 
+class ThreadPool;
+
+// A read-only mapping of a whole file, released on destruction. Decoding from the mapped bytes
+// with the memory loads lets several decodes of one file share a single mapping.
+class BmpMappedFile
+{
+public:
+  explicit BmpMappedFile(const std::string& filename);
+  ~BmpMappedFile();
+  BmpMappedFile(const BmpMappedFile&) = delete;
+  BmpMappedFile& operator=(const BmpMappedFile&) = delete;
+  bool isMapped() const {return _bytes != nullptr;}
+  const uint8_t* getBytes() const {return _bytes;}
+  size_t getSize() const {return _size_bytes;}
+private:
+  const uint8_t* _bytes;
+  size_t _size_bytes;
+};
+
 class BmpImage
 {
 public:
-  int load(std::string filename);
-  const std::vector<Color4>& getPixels() const {return _pixels;}
-  int getWidth() const {return _width_px;}
-  int getHeight() const {return _height_px;}
+  static constexpr int DEFAULT_PARALLEL_MIN_PIXELS {1 << 20};
+  static constexpr int MAX_MIP_LEVELS {16};
 
-private:
-  static constexpr uint32_t BMPMAGIC {0x4D42};
-  static constexpr uint32_t SRGBMAGIC {0x73524742};
+  enum LoadMode
+  {
+    LOAD_STREAMED,   // read the file a row at a time through an ifstream.
+    LOAD_MAPPED      // memory map the file and decode the rows in place.
+  };
 
-  static constexpr uint32_t FILEHEADER_SIZE_BYTES {14};
-  static constexpr uint32_t V1INFOHEADER_SIZE_BYTES {40};
-  static constexpr uint32_t V2INFOHEADER_SIZE_BYTES {52};
-  static constexpr uint32_t V3INFOHEADER_SIZE_BYTES {56};
-  static constexpr uint32_t V4INFOHEADER_SIZE_BYTES {108};
-  static constexpr uint32_t V5INFOHEADER_SIZE_BYTES {124};
+  enum OutputFormat
+  {
+    OUTPUT_RGBA8,    // 4 bytes per pixel in the byte order red, green, blue, alpha (a Color4).
+    OUTPUT_BGRA8,    // 4 bytes per pixel in the byte order blue, green, red, alpha.
+    OUTPUT_RGB565,   // a uint16_t per pixel; red in the 5 MSBs, blue in the 5 LSBs.
+    OUTPUT_PLANAR8   // 4 consecutive planes (red, green, blue, alpha) of 1 byte per pixel.
+  };
+
+  // Caller owned memory to decode into. Rows are stored bottom row first, each row starting
+  // rowStride bytes after the last. For planar output the stride is that of a plane's rows
+  // and each plane starts (rowStride * height) bytes after the last.
+  struct OutputBuffer
+  {
+    void* _pixels;
+    size_t _size_bytes;
+    int _rowStride_bytes;
+    OutputFormat _format;
+  };
+
+  // A rectangle of pixels with its origin in the bottom left of the image, rows ascending up
+  // and columns ascending right, as the pixels are stored in memory.
+  struct Region
+  {
+    int _x;
+    int _y;
+    int _w;
+    int _h;
+  };
+
+  enum EncodeFormat
+  {
+    ENCODE_BGR24,      // 24bpp BI_RGB; alpha is dropped.
+    ENCODE_BGRA32,     // 32bpp BI_BITFIELDS with an alpha mask, in a v4 info header.
+    ENCODE_RGB565,     // 16bpp BI_BITFIELDS; the low bits of each channel are dropped.
+    ENCODE_INDEXED8    // 8bpp BI_RGB with a palette of the image's colors, which must number at
+                       // most 256 once alpha (which is dropped) is ignored.
+  };
+
+  struct EncodeOptions
+  {
+    EncodeFormat _format;
+    bool _isTopOrigin;   // the pixels are stored top row first and are written as a top-down
+                         // bitmap; else bottom row first (as by getPixels) and bottom-up.
+  };
 
+  enum MipFilter
+  {
+    MIP_NONE,        // load only the image.
+    MIP_BOX,         // average each 2x2 block of pixels.
+    MIP_BOX_SRGB     // average the colors in linear light, taking them to be sRGB; alpha is
+                     // averaged as is.
+  };
+
+  // A level of a mip pyramid; level 0 is the image itself.
+  struct MipLevel
+  {
+    size_t _offset_px;   // from the start of getPixels.
+    int _width_px;
+    int _height_px;
+  };
+
+  // the values of Info::_compression.
   enum Compression
   {
     BI_RGB = 0, 
@@ -42,6 +122,145 @@ private:
     BI_CMYKRLE4
   };
 
+  // The metadata of a bitmap file as read from its headers.
+  struct Info
+  {
+    int _width_px;
+    int _height_px;              // always positive; see _isTopOrigin for the row order.
+    int _bitsPerPixel;
+    uint32_t _compression;
+    uint32_t _redMask;
+    uint32_t _greenMask;
+    uint32_t _blueMask;
+    uint32_t _alphaMask;
+    int _numPaletteColors;       // 0 for full color images.
+    bool _isTopOrigin;           // true if the top row is first in the file.
+    uint32_t _pixelOffset_bytes;
+  };
+
+  // Where the time of loads went, and what they cost in reads, seeks and allocations. Stats
+  // are only recorded by builds which define BMP_STATS; otherwise the decode never touches
+  // them and they stay zero. The stage times of a parallel decode are summed over its threads
+  // so may add up to more than the total.
+  struct DecodeStats
+  {
+    int64_t _numLoads;
+    int64_t _numFailedLoads;
+    int64_t _total_ns;
+    int64_t _open_ns;            // opening or mapping the file.
+    int64_t _headers_ns;         // reading and parsing the headers.
+    int64_t _palette_ns;         // reading the palette and building its lookup table.
+    int64_t _read_ns;            // seeking to and fetching the rows (or the rle data).
+    int64_t _convert_ns;         // converting the rows to the output, and fused mip filtering.
+    int64_t _mips_ns;            // filtering the smaller mip levels.
+    int64_t _read_bytes;         // fetched from the file or memory, including the headers.
+    int64_t _numReads;           // reads of a stream, each about one read system call.
+    int64_t _numSeeks;           // seeks and tells of a stream, each one lseek.
+    int64_t _numSyscalls;        // the reads and seeks, plus the calls to open, map and close.
+    int64_t _numAllocations;     // growths of the pixels and scratch memory.
+    int64_t _allocated_bytes;
+  };
+
+public:
+  // the pixels, and the scratch memory used while decoding, are allocated from resource (e.g.
+  // an arena) and are kept for reuse by later loads.
+  explicit BmpImage(std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+  // each load replaces the image, overwriting its pixels in place, so once an image has held
+  // one as large, reloading allocates nothing (bar the stream buffer of a streamed load, and
+  // the tasks of a parallel decode). A failed load leaves the image empty.
+  int load(const std::string& filename, LoadMode mode = LOAD_STREAMED);
+
+  // decode a bitmap file already held in memory; the bytes are only read during the call.
+  int loadFromMemory(const void* data, size_t size_bytes);
+  int loadFromMemory(const std::vector<uint8_t>& bytes) {return loadFromMemory(bytes.data(), bytes.size());}
+
+  // decode directly into caller owned memory instead of the pixels held by this image; fails
+  // without writing anything if the buffer is too small for the image.
+  int loadInto(const std::string& filename, const OutputBuffer& output, LoadMode mode = LOAD_STREAMED);
+  int loadFromMemoryInto(const void* data, size_t size_bytes, const OutputBuffer& output);
+
+  // decode only a region of the image (e.g. a row range, or a tile of a sheet); the image then
+  // has the size of the region. Only the rows of the region are read from the file, and only
+  // the bytes of each row which hold the region's columns.
+  int loadRegion(const std::string& filename, const Region& region, LoadMode mode = LOAD_STREAMED);
+  int loadRegionFromMemory(const void* data, size_t size_bytes, const Region& region);
+  int loadRegionInto(const std::string& filename, const Region& region, const OutputBuffer& output, LoadMode mode = LOAD_STREAMED);
+
+  // read only the headers of a bitmap; fails for any file load would fail to decode.
+  static int probe(const std::string& filename, Info& info);
+  static int probeMemory(const void* data, size_t size_bytes, Info& info);
+  static std::vector<int> probe(const std::vector<std::string>& filenames, std::vector<Info>& infos);
+
+  // encode pixels as a bitmap file, either into memory or straight to a file. Rows are packed
+  // and written in large batches, in the order they are stored, so no rows are reversed.
+  static int encode(const Color4* pixels, int width_px, int height_px, const EncodeOptions& options, std::vector<uint8_t>& bytes);
+  static int save(const std::string& filename, const Color4* pixels, int width_px, int height_px, const EncodeOptions& options);
+  int save(const std::string& filename, const EncodeOptions& options) const;
+
+  // the size of an encoded bitmap; an upper bound for indexed bitmaps, whose palettes hold
+  // only the colors used.
+  static size_t getEncodedSize_bytes(int width_px, int height_px, EncodeFormat format);
+
+  static int getOutputPixelSize_bytes(OutputFormat format);
+  static size_t getOutputSize_bytes(int width_px, int height_px, int rowStride_bytes, OutputFormat format);
+
+  // split the rows of images with at least minPixels pixels into bands decoded in parallel by
+  // the loading thread and the workers of a pool; either a pool of numThreads - 1 workers kept
+  // by the image (and its copies), or a caller's pool, which must outlive the loads, and may
+  // also run the loads themselves (e.g. that of a BmpBatchLoader). Only mapped and in-memory
+  // loads decode in parallel; streamed loads read rows in sequence.
+  void setParallelDecode(int numThreads, int minPixels = DEFAULT_PARALLEL_MIN_PIXELS);
+  void setParallelDecode(ThreadPool* pool, int minPixels = DEFAULT_PARALLEL_MIN_PIXELS);
+
+  // build a full mip pyramid, down to 1x1, for each image loaded into this image (but not into
+  // a caller's buffer). Each level halves the size of the last, rounding down, so the last row
+  // or column of an odd sized level is left out of the next.
+  void setMipmaps(MipFilter filter);
+
+  // the stats of the last load into this image, and the sum of the stats of every load in the
+  // process since the last reset. Probes and encodes are not counted.
+  const DecodeStats& getDecodeStats() const {return _decodeStats;}
+  static DecodeStats getTotalDecodeStats();
+  static void resetTotalDecodeStats();
+
+  // the stats as a json object with a member per field, named as the field without its
+  // leading underscore, plus "enabled", which is false if the stats are compiled out.
+  static std::string formatJson(const DecodeStats& stats);
+
+  // the image's pixels, followed by its mip levels, if any, in the same allocation.
+  const std::pmr::vector<Color4>& getPixels() const {return _pixels;}
+  int getNumMipLevels() const {return _numMipLevels;}
+  const MipLevel& getMipLevel(int level) const {return _mipLevels[level];}
+  int getWidth() const {return _width_px;}
+  int getHeight() const {return _height_px;}
+
+private:
+  static constexpr uint32_t BMPMAGIC {0x4D42};
+  static constexpr uint32_t SRGBMAGIC {0x73524742};
+
+  static constexpr uint32_t FILEHEADER_SIZE_BYTES {14};
+  static constexpr uint32_t V1INFOHEADER_SIZE_BYTES {40};
+  static constexpr uint32_t V2INFOHEADER_SIZE_BYTES {52};
+  static constexpr uint32_t V3INFOHEADER_SIZE_BYTES {56};
+  static constexpr uint32_t V4INFOHEADER_SIZE_BYTES {108};
+  static constexpr uint32_t V5INFOHEADER_SIZE_BYTES {124};
+  static constexpr uint32_t V1MASKS_SIZE_BYTES {12};
+  static constexpr uint32_t MAX_HEADERS_SIZE_BYTES {FILEHEADER_SIZE_BYTES + V5INFOHEADER_SIZE_BYTES};
+  static constexpr uint32_t MAX_PALETTE_COLORS {256};
+  static constexpr int32_t MAX_DIMENSION_PX {1 << 15};
+  static constexpr int64_t MAX_PIXELS {1 << 28};
+  static constexpr size_t ENCODE_BATCH_SIZE_BYTES {1 << 18};
+  static constexpr int32_t ENCODE_RESOLUTION_PXPM {2835};   // 72 dpi.
+
+  // escape codes which follow a zero count in RLE8 and RLE4 compressed pixel data.
+  enum RleEscape
+  {
+    RLE_END_OF_LINE = 0,
+    RLE_END_OF_BITMAP,
+    RLE_DELTA
+  };
+
   struct FileHeader
   {
     uint16_t _fileMagic;
@@ -71,14 +290,73 @@ private:
     uint32_t _colorSpaceMagic;
   };
 
+  // The source of the pixel bytes; either a stream, from which each row must be read into
+  // scratch memory, or a block of memory (e.g. a mapped file) in which rows are decoded in place.
+  struct PixelSource
+  {
+    std::ifstream* _file;
+    const uint8_t* _bytes;
+    size_t _size_bytes;
+  };
+
+  // Where the rows of the pixel array (or of a region of it) lie in the file, in the order
+  // they are decoded.
+  struct RowLayout
+  {
+    int _width_px;
+    int _numRows;
+    int _rowSize_bytes;
+    int _firstRowOffset_bytes;  // offset of the first byte fetched from the bottom row.
+    int _rowStep_bytes;         // signed offset from one row to the row above it.
+    int _rowFetch_bytes;        // the bytes fetched from each row.
+    int _skip_px;               // leading pixels in the first fetched byte which are not decoded.
+  };
+
 private:
-  void extractIndexedPixels(std::ifstream& file, FileHeader& fileHead, InfoHeader& infoHead);
-  void extractPixels(std::ifstream& file, FileHeader& fileHead, InfoHeader& infoHead);
+  int discardIfFailed(int result);
+  int loadFile(const std::string& filename, LoadMode mode, const Region* region, const OutputBuffer* output);
+  int loadMemory(const uint8_t* bytes, size_t size_bytes, const Region* region, const OutputBuffer* output);
+  int loadStreamed(const std::string& filename, const Region* region, const OutputBuffer* output);
+  int loadMapped(const std::string& filename, const Region* region, const OutputBuffer* output);
+  int loadBytes(const uint8_t* bytes, size_t size_bytes, const Region* region, const OutputBuffer* output);
+  static int parseHeaders(const uint8_t* bytes, size_t size_bytes, FileHeader& fileHead, InfoHeader& infoHead);
+  int extract(PixelSource& source, FileHeader& fileHead, InfoHeader& infoHead, const Region* region, const OutputBuffer* output);
+  int extractIndexedPixels(PixelSource& source, FileHeader& fileHead, InfoHeader& infoHead, const Region& region, const OutputBuffer& output);
+  int extractPixels(PixelSource& source, FileHeader& fileHead, InfoHeader& infoHead, const Region& region, const OutputBuffer& output);
+  int extractRlePixels(PixelSource& source, FileHeader& fileHead, InfoHeader& infoHead, const Region& region, const OutputBuffer& output);
+  int readPalette(PixelSource& source, InfoHeader& infoHead);
+  template<typename DecodeRow>
+  int decodeRows(PixelSource& source, const RowLayout& layout, const OutputBuffer& output, DecodeRow decodeRow);
+  static uint32_t getNumPaletteColors(const InfoHeader& infoHead);
+  static void fillInfo(const FileHeader& fileHead, const InfoHeader& infoHead, Info& info);
+  size_t layoutMipLevels(int width_px, int height_px);
+  void filterMipRow(int level, int rowNo);
+  void buildMipLevels(int firstLevel);
+  static RowLayout computeRowLayout(const FileHeader& fileHead, const InfoHeader& infoHead, const Region& region);
+  static int64_t getSourceSize(PixelSource& source, DecodeStats& stats);
+  static const uint8_t* fetchBytes(PixelSource& source, size_t offset, size_t size, char* scratch, DecodeStats* stats);
+  template<typename Write>
+  static int encodeTo(const Color4* pixels, int width_px, int height_px, const EncodeOptions& options, Write write);
+  static void makeHeaders(int width_px, int height_px, const EncodeOptions& options, int numPaletteColors, FileHeader& fileHead, InfoHeader& infoHead);
+  static uint8_t* writeHeaders(const FileHeader& fileHead, const InfoHeader& infoHead, uint8_t* bytes);
 
 private:
-  std::vector<Color4> _pixels;
+  std::pmr::vector<Color4> _pixels;
+  std::pmr::vector<Color4> _palette;      // scratch memory reused by each load.
+  std::pmr::vector<Color4> _lut;
+  std::pmr::vector<Color4> _rowPixels;
+  std::pmr::vector<char> _fileBytes;      // bytes read from a stream.
   int _width_px;
   int _height_px;
+  std::shared_ptr<ThreadPool> _ownDecodePool;
+  ThreadPool* _decodePool {nullptr};
+  int _minParallelPixels {DEFAULT_PARALLEL_MIN_PIXELS};
+  MipFilter _mipFilter {MIP_NONE};
+  void (*_mipRowFilter)(const Color4* rowA, const Color4* rowB, Color4* mipRow, int width_px) {nullptr};  // selected per load.
+  MipLevel _mipLevels[MAX_MIP_LEVELS];
+  int _numMipLevels;
+  bool _isFusingMips {false};     // true while the first mip level is filtered during a decode.
+  DecodeStats _decodeStats {};
 };
 
 #endif
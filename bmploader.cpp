@@ -0,0 +1,58 @@
+//----------------------------------------------------------------------------------------------//
+// FILE: bmploader.cpp                                                                          //
+// AUTHOR: Ian Murfin - github.com/ianmurfinxyz                                                 //
+//----------------------------------------------------------------------------------------------//
+
+#include <fstream>
+#include "bmploader.h"
+
+BmpBatchLoader::BmpBatchLoader(int numThreads) :
+  _pool{numThreads}
+{}
+
+std::vector<BmpBatchLoader::Result> BmpBatchLoader::load(const std::vector<std::string>& filenames)
+{
+  std::vector<Result> results(filenames.size(), Result{ERROR_NONE, 0, 0, {}});
+  for(size_t i = 0; i < filenames.size(); ++i){
+    _pool.submit([this, &filenames, &results, i](){
+      results[i] = decodeMapped(filenames[i], &_pool);
+    });
+  }
+  _pool.wait();
+  return results;
+}
+
+BmpBatchLoader::Result BmpBatchLoader::decodeFile(const std::string& filename)
+{
+  return decodeMapped(filename, nullptr);
+}
+
+// the file is mapped and its headers parsed once; with a pool, the bands of a big image are
+// decoded from the same mapping on the pool's workers, the caller's task decoding one of them.
+BmpBatchLoader::Result BmpBatchLoader::decodeMapped(const std::string& filename, ThreadPool* pool)
+{
+  BmpMappedFile mapped {filename};
+  if(!mapped.isMapped())
+    return Result{std::ifstream{filename}.is_open() ? ERROR_HEADER : ERROR_OPEN, 0, 0, {}};
+
+  BmpImage::Info info {};
+  if(BmpImage::probeMemory(mapped.getBytes(), mapped.getSize(), info) != 0)
+    return Result{ERROR_HEADER, 0, 0, {}};
+
+  Result result {ERROR_NONE, info._width_px, info._height_px, {}};
+  result._pixels.resize(static_cast<size_t>(info._width_px) * info._height_px);
+
+  BmpImage::OutputBuffer output {
+    result._pixels.data(),
+    result._pixels.size() * sizeof(Color4),
+    info._width_px * static_cast<int>(sizeof(Color4)),
+    BmpImage::OUTPUT_RGBA8
+  };
+  BmpImage image {};
+  if(pool != nullptr)
+    image.setParallelDecode(pool, MIN_SPLIT_PIXELS);
+  if(image.loadFromMemoryInto(mapped.getBytes(), mapped.getSize(), output) != 0)
+    return Result{ERROR_DECODE, 0, 0, {}};
+
+  return result;
+}
@@ -0,0 +1,62 @@
+#ifndef _BMP_LOADER_H_
+#define _BMP_LOADER_H_
+
+//----------------------------------------------------------------------------------------------//
+// FILE: bmploader.h                                                                            //
+// AUTHOR: Ian Murfin - github.com/ianmurfinxyz                                                 //
+//----------------------------------------------------------------------------------------------//
+
+#include <string>
+#include <vector>
+#include "bmpimage.h"
+#include "threadpool.h"
+#include "color.h"
+
+// Decodes batches of bitmap files concurrently. Each file is mapped and decoded by a task on
+// the pool; the rows of big images are split into bands decoded by the other workers too, so
+// one huge image does not leave the other threads idle. The bands share the file's mapping,
+// headers and palette.
+class BmpBatchLoader
+{
+public:
+  static constexpr int MIN_SPLIT_PIXELS {1 << 18};
+
+  enum Error
+  {
+    ERROR_NONE = 0,
+    ERROR_OPEN,      // the file could not be opened.
+    ERROR_HEADER,    // the headers are malformed or describe an unsupported format.
+    ERROR_DECODE     // the pixel data is truncated or corrupt.
+  };
+
+  struct Result
+  {
+    Error _error;
+    int _width_px;
+    int _height_px;
+    std::vector<Color4> _pixels;   // as BmpImage::getPixels; empty on error.
+  };
+
+public:
+  // numThreads of 0 uses one thread per hardware thread.
+  explicit BmpBatchLoader(int numThreads = 0);
+  ~BmpBatchLoader() = default;
+  BmpBatchLoader(const BmpBatchLoader&) = delete;
+  BmpBatchLoader& operator=(const BmpBatchLoader&) = delete;
+
+  // returns one result per file in the order of filenames.
+  std::vector<Result> load(const std::vector<std::string>& filenames);
+
+  // decodes a single file on the calling thread.
+  static Result decodeFile(const std::string& filename);
+
+  int getNumThreads() const {return _pool.getNumThreads();}
+
+private:
+  static Result decodeMapped(const std::string& filename, ThreadPool* pool);
+
+private:
+  ThreadPool _pool;
+};
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef _BMP_SIMD_H_
+#define _BMP_SIMD_H_
+
+//----------------------------------------------------------------------------------------------//
+// FILE: bmpsimd.h                                                                              //
+// AUTHOR: Ian Murfin - github.com/ianmurfinxyz                                                 //
+//----------------------------------------------------------------------------------------------//
+
+// The cpu feature detection shared by the row converters and the span blitters. Each kernel
+// has a portable scalar version and, on x86, ssse3 and avx2 versions built with per function
+// target attributes, so the rest of the build needs no -m flags; the fastest version the cpu
+// supports is selected at run time.
+//
+// note: the avx2 kernels call _mm256_zeroupper before handing the tail of a row to a narrower
+// kernel. gcc does not always clear the upper halves of the registers before a tail call, and
+// the legacy sse encoding of the ssse3 kernels then stalls on every instruction.
+
+// define BMP_NO_SIMD to build only the portable scalar kernels.
+#if !defined(BMP_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BMP_HAS_X86_SIMD
+#include <immintrin.h>
+#endif
+
+// expands to the ssse3 and avx2 entries of a kernel table indexed by SimdLevel.
+#ifdef BMP_HAS_X86_SIMD
+#define BMP_SIMD_KERNELS(ssse3, avx2) ssse3, avx2
+#else
+#define BMP_SIMD_KERNELS(ssse3, avx2) nullptr, nullptr
+#endif
+
+enum SimdLevel { SIMD_NONE, SIMD_SSSE3, SIMD_AVX2 };
+
+// queried once; the cpu cannot change under us.
+inline SimdLevel getSimdLevel()
+{
+#ifdef BMP_HAS_X86_SIMD
+  static const SimdLevel level = [](){
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+    if(__builtin_cpu_supports("ssse3")) return SIMD_SSSE3;
+    return SIMD_NONE;
+  }();
+  return level;
+#else
+  return SIMD_NONE;
+#endif
+}
+
+#endif
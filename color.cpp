@@ -0,0 +1,163 @@
+//----------------------------------------------------------------------------------------------//
+// FILE: color.cpp                                                                              //
+// AUTHOR: Ian Murfin - github.com/ianmurfinxyz                                                 //
+//----------------------------------------------------------------------------------------------//
+
+#include <cmath>
+#include <cstring>
+#include "color.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#include <xmmintrin.h>
+#endif
+
+static_assert(sizeof(Color4) == 4, "the batch conversions treat colors as packed rgba bytes");
+
+namespace
+{
+
+// must match the vector paths exactly so the result does not depend on where a color falls in
+// a batch; the comparisons send NaN to 0 as _mm_max_ps does.
+uint8_t toChannel(float value)
+{
+  float scaled {value * 255.f};
+  scaled = scaled > 0.f ? scaled : 0.f;
+  scaled = scaled < 255.f ? scaled : 255.f;
+  return static_cast<uint8_t>(std::nearbyint(scaled));
+}
+
+#ifdef __SSE2__
+
+// widens 4 packed colors to one vector of floats per color. Divides rather than multiplying by
+// the reciprocal so the floats equal those from getfRed etc; the two differ in the last bit for
+// about half of all byte values.
+void widenColors(const Color4* colors, __m128 out[4])
+{
+  const __m128i zero {_mm_setzero_si128()};
+  const __m128 max {_mm_set1_ps(255.f)};
+  __m128i bytes {_mm_loadu_si128(reinterpret_cast<const __m128i*>(colors))};
+  __m128i lo {_mm_unpacklo_epi8(bytes, zero)};
+  __m128i hi {_mm_unpackhi_epi8(bytes, zero)};
+  out[0] = _mm_div_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), max);
+  out[1] = _mm_div_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), max);
+  out[2] = _mm_div_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), max);
+  out[3] = _mm_div_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)), max);
+}
+
+// clamps before converting since cvtps turns out of range values into INT_MIN, which the packs
+// would saturate to 0 rather than 255.
+__m128i toChannels(__m128 values)
+{
+  const __m128 max {_mm_set1_ps(255.f)};
+  __m128 scaled {_mm_mul_ps(values, max)};
+  scaled = _mm_min_ps(_mm_max_ps(scaled, _mm_setzero_ps()), max);
+  return _mm_cvtps_epi32(scaled);
+}
+
+// narrows one vector of floats per color to 4 packed colors.
+void narrowColors(const __m128 in[4], Color4* colors)
+{
+  __m128i lo {_mm_packs_epi32(toChannels(in[0]), toChannels(in[1]))};
+  __m128i hi {_mm_packs_epi32(toChannels(in[2]), toChannels(in[3]))};
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(colors), _mm_packus_epi16(lo, hi));
+}
+
+#endif
+
+} // namespace
+
+void convertToFloats(const Color4* colors, size_t numColors, float* rgba)
+{
+  size_t i {0};
+#ifdef __SSE2__
+  for(; i + 4 <= numColors; i += 4){
+    __m128 pixels[4];
+    widenColors(colors + i, pixels);
+    for(int j = 0; j < 4; ++j)
+      _mm_storeu_ps(rgba + ((i + j) * 4), pixels[j]);
+  }
+#endif
+  for(; i < numColors; ++i){
+    rgba[(i * 4) + 0] = colors[i].getfRed();
+    rgba[(i * 4) + 1] = colors[i].getfGreen();
+    rgba[(i * 4) + 2] = colors[i].getfBlue();
+    rgba[(i * 4) + 3] = colors[i].getfAlpha();
+  }
+}
+
+void convertToFloatPlanes(const Color4* colors, size_t numColors, float* red, float* green, float* blue, float* alpha)
+{
+  size_t i {0};
+#ifdef __SSE2__
+  for(; i + 4 <= numColors; i += 4){
+    __m128 pixels[4];
+    widenColors(colors + i, pixels);
+    _MM_TRANSPOSE4_PS(pixels[0], pixels[1], pixels[2], pixels[3]);
+    _mm_storeu_ps(red + i, pixels[0]);
+    _mm_storeu_ps(green + i, pixels[1]);
+    _mm_storeu_ps(blue + i, pixels[2]);
+    _mm_storeu_ps(alpha + i, pixels[3]);
+  }
+#endif
+  for(; i < numColors; ++i){
+    red[i] = colors[i].getfRed();
+    green[i] = colors[i].getfGreen();
+    blue[i] = colors[i].getfBlue();
+    alpha[i] = colors[i].getfAlpha();
+  }
+}
+
+void convertFromFloats(const float* rgba, size_t numColors, Color4* colors)
+{
+  size_t i {0};
+#ifdef __SSE2__
+  for(; i + 4 <= numColors; i += 4){
+    __m128 pixels[4];
+    for(int j = 0; j < 4; ++j)
+      pixels[j] = _mm_loadu_ps(rgba + ((i + j) * 4));
+    narrowColors(pixels, colors + i);
+  }
+#endif
+  for(; i < numColors; ++i)
+    colors[i] = Color4{toChannel(rgba[(i * 4) + 0]), toChannel(rgba[(i * 4) + 1]), toChannel(rgba[(i * 4) + 2]), toChannel(rgba[(i * 4) + 3])};
+}
+
+void convertFromFloatPlanes(const float* red, const float* green, const float* blue, const float* alpha, size_t numColors, Color4* colors)
+{
+  size_t i {0};
+#ifdef __SSE2__
+  for(; i + 4 <= numColors; i += 4){
+    __m128 pixels[4] {
+      _mm_loadu_ps(red + i),
+      _mm_loadu_ps(green + i),
+      _mm_loadu_ps(blue + i),
+      _mm_loadu_ps(alpha + i)
+    };
+    _MM_TRANSPOSE4_PS(pixels[0], pixels[1], pixels[2], pixels[3]);
+    narrowColors(pixels, colors + i);
+  }
+#endif
+  for(; i < numColors; ++i)
+    colors[i] = Color4{toChannel(red[i]), toChannel(green[i]), toChannel(blue[i]), toChannel(alpha[i])};
+}
+
+void fillColors(Color4* colors, size_t numColors, Color4 color)
+{
+  size_t i {0};
+#ifdef __SSE2__
+  int bits;
+  std::memcpy(&bits, &color, sizeof(bits));
+  const __m128i fill {_mm_set1_epi32(bits)};
+  for(; i + 16 <= numColors; i += 16){
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(colors + i), fill);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(colors + i + 4), fill);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(colors + i + 8), fill);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(colors + i + 12), fill);
+  }
+  for(; i + 4 <= numColors; i += 4)
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(colors + i), fill);
+#endif
+  for(; i < numColors; ++i)
+    colors[i] = color;
+}
@@ -2,6 +2,7 @@
 #define _COLOR_H_
 
 #include <cinttypes>
+#include <cstddef>
 #include <algorithm>
 
 class Color4
@@ -45,4 +46,16 @@ private:
   uint8_t _a;
 };
 
+// Batch conversions between colors and normalized float channels. Interleaved buffers hold 4
+// floats (red, green, blue, alpha) per color; planar buffers hold a plane of numColors floats
+// per channel. Colors convert to exactly the floats getfRed etc. return; floats convert back
+// rounded to nearest, saturated to [0, 255], with NaN becoming 0.
+void convertToFloats(const Color4* colors, size_t numColors, float* rgba);
+void convertToFloatPlanes(const Color4* colors, size_t numColors, float* red, float* green, float* blue, float* alpha);
+void convertFromFloats(const float* rgba, size_t numColors, Color4* colors);
+void convertFromFloatPlanes(const float* red, const float* green, const float* blue, const float* alpha, size_t numColors, Color4* colors);
+
+// sets every color in the buffer to color.
+void fillColors(Color4* colors, size_t numColors, Color4 color);
+
 #endif
@@ -23,11 +23,18 @@
 #include <vector>
 #include <memory>
 #include <fstream>
+#include <future>
 
+// define EXAMPLE_NO_SDL to build only the headless runner, for machines without SDL or gl.
+#ifndef EXAMPLE_NO_SDL
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_opengl.h>
+#endif
 
 #include "../bmpimage.h"
+#include "../bmpasync.h"
+#include "../bmpatlas.h"
+#include "../bmpblit.h"
 
 namespace pxr  // pixiretro
 {
@@ -102,6 +109,9 @@ namespace logstr
   constexpr const char* fail_create_opengl_context = "failed to create opengl context";
   constexpr const char* fail_set_opengl_attribute = "failed to set opengl attribute";
   constexpr const char* fail_create_window = "failed to create window";
+  constexpr const char* fail_load_bitmap = "failed to load bitmap";
+  constexpr const char* fail_build_atlas = "failed to build sprite atlas";
+  constexpr const char* fail_save_frame = "failed to save frame";
 
   constexpr const char* info_stderr_log = "logging to standard error";
   constexpr const char* info_creating_window = "creating window";
@@ -176,13 +186,17 @@ public:
 public:
   Input();
   ~Input() = default;
+#ifndef EXAMPLE_NO_SDL
   void onKeyEvent(const SDL_Event& event);
+#endif
   void onUpdate();
   bool isKeyDown(KeyCode key) {return _keys[key]._isDown;}
   bool isKeyPressed(KeyCode key) {return _keys[key]._isPressed;}
   bool isKeyReleased(KeyCode key) {return _keys[key]._isReleased;}
 private:
+#ifndef EXAMPLE_NO_SDL
   KeyCode convertSdlKeyCode(int sdlCode);
+#endif
 private:
   std::array<KeyLog, KEY_COUNT> _keys;
 };
@@ -195,6 +209,7 @@ Input::Input()
     key._isDown = key._isReleased = key._isPressed = false;
 }
 
+#ifndef EXAMPLE_NO_SDL
 void Input::onKeyEvent(const SDL_Event& event)
 {
   assert(event.type == SDL_KEYDOWN || event.type == SDL_KEYUP);
@@ -214,12 +229,16 @@ void Input::onKeyEvent(const SDL_Event& event)
   }
 }
 
+#endif
+
 void Input::onUpdate()
 {
   for(auto& key : _keys)
     key._isPressed = key._isReleased = false;
 }
 
+#ifndef EXAMPLE_NO_SDL
+
 Input::KeyCode Input::convertSdlKeyCode(int sdlCode)
 {
   switch(sdlCode) {
@@ -259,6 +278,7 @@ Input::KeyCode Input::convertSdlKeyCode(int sdlCode)
     default: return KEY_COUNT;
   }
 }
+#endif
 
 std::unique_ptr<Input> input {nullptr};
 
@@ -292,6 +312,7 @@ constexpr Color4 gainsboro {224, 224, 224};
 constexpr Color4 jet {53, 53, 53};
 };
 
+#ifndef EXAMPLE_NO_SDL
 class Renderer
 {
 public:
@@ -309,7 +330,8 @@ public:
   void setViewport(iRect viewport);
   void clearWindow(const Color4& color);
   void clearViewport(const Color4& color);
-  void drawPixelArray(int first, int count, void* pixels, int pixelSize);
+  void updateScreenTexture(Vector2i screenSize, const Color4* colors, iRect region);
+  void drawScreenTexture(iRect windowRect);
   void show();
   Vector2i getWindowSize() const;
 private:
@@ -320,9 +342,11 @@ private:
   SDL_GLContext _glContext;
   Config _config;
   iRect _viewport;
+  GLuint _screenTexture;
 };
 
-Renderer::Renderer(const Config& config)
+Renderer::Renderer(const Config& config) :
+  _screenTexture{0}
 {
   _config = config;
 
@@ -371,6 +395,8 @@ Renderer::Renderer(const Config& config)
 
 Renderer::~Renderer()
 {
+  if(_screenTexture != 0)
+    glDeleteTextures(1, &_screenTexture);
   SDL_GL_DeleteContext(_glContext);
   SDL_DestroyWindow(_window);
 }
@@ -401,11 +427,50 @@ void Renderer::clearViewport(const Color4& color)
   glDisable(GL_SCISSOR_TEST);
 }
 
-void Renderer::drawPixelArray(int first, int count, void* pixels, int pixelSize)
+// the screen texture keeps its pixels between frames, so only the region of the screen's colors
+// which has changed is uploaded. The texture is created by the first upload.
+void Renderer::updateScreenTexture(Vector2i screenSize, const Color4* colors, iRect region)
+{
+  if(_screenTexture == 0){
+    glGenTextures(1, &_screenTexture);
+    glBindTexture(GL_TEXTURE_2D, _screenTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, screenSize._x, screenSize._y, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+  }
+  else
+    glBindTexture(GL_TEXTURE_2D, _screenTexture);
+
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, screenSize._x);
+  const Color4* first {colors + region._x + (region._y * screenSize._x)};
+  glTexSubImage2D(GL_TEXTURE_2D, 0, region._x, region._y, region._w, region._h, GL_RGBA, GL_UNSIGNED_BYTE, first);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
+// draws the screen texture stretched over the rect with nearest filtering, so each virtual pixel
+// covers a square of window pixels.
+void Renderer::drawScreenTexture(iRect windowRect)
 {
-  glInterleavedArrays(GL_C4UB_V2F, 0, pixels);
-  glPointSize(pixelSize);
-  glDrawArrays(GL_POINTS, first, count);
+  if(_screenTexture == 0)
+    return;
+
+  glEnable(GL_TEXTURE_2D);
+  glBindTexture(GL_TEXTURE_2D, _screenTexture);
+  glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+  glBegin(GL_QUADS);
+  glTexCoord2f(0.f, 0.f);
+  glVertex2i(windowRect._x, windowRect._y);
+  glTexCoord2f(1.f, 0.f);
+  glVertex2i(windowRect._x + windowRect._w, windowRect._y);
+  glTexCoord2f(1.f, 1.f);
+  glVertex2i(windowRect._x + windowRect._w, windowRect._y + windowRect._h);
+  glTexCoord2f(0.f, 1.f);
+  glVertex2i(windowRect._x, windowRect._y + windowRect._h);
+  glEnd();
+  glDisable(GL_TEXTURE_2D);
 }
 
 void Renderer::show()
@@ -421,6 +486,63 @@ Vector2i Renderer::getWindowSize() const
 }
 
 std::unique_ptr<Renderer> renderer {nullptr};
+#endif
+
+// Presents the screen on the cpu into a window sized image, for machines with no display or gl
+// (e.g. build and test machines). The image has the layout of BmpImage::getPixels, bottom row
+// first as the window's viewport, and keeps its pixels between frames as the screen texture of
+// the gl renderer does, so only the dirty regions of the screen are drawn each frame.
+class SoftwareRenderer
+{
+public:
+  explicit SoftwareRenderer(Vector2i windowSize);
+  ~SoftwareRenderer() = default;
+  void setWindowSize(Vector2i windowSize);
+  void clearWindow(const Color4& color);
+  void drawScreenRegion(const Color4* colors, Vector2i screenSize, iRect region, Vector2i position, int pixelSize);
+  int saveWindow(const std::string& filename) const;
+  const std::vector<Color4>& getWindowPixels() const {return _pixels;}
+  Vector2i getWindowSize() const {return _windowSize;}
+private:
+  Vector2i _windowSize;
+  std::vector<Color4> _pixels;
+};
+
+SoftwareRenderer::SoftwareRenderer(Vector2i windowSize) :
+  _windowSize{0, 0},
+  _pixels{}
+{
+  setWindowSize(windowSize);
+}
+
+// the window's pixels are lost, so the whole screen must be drawn again.
+void SoftwareRenderer::setWindowSize(Vector2i windowSize)
+{
+  _windowSize = windowSize;
+  _pixels.assign(static_cast<size_t>(windowSize._x) * windowSize._y, Color4{});
+}
+
+void SoftwareRenderer::clearWindow(const Color4& color)
+{
+  fillColors(_pixels.data(), _pixels.size(), color);
+}
+
+// scales the region of the screen's colors up by the pixel size into the window, with the
+// screen's bottom left corner at position.
+void SoftwareRenderer::drawScreenRegion(const Color4* colors, Vector2i screenSize, iRect region, Vector2i position, int pixelSize)
+{
+  BlitSource source {colors + region._x + (region._y * screenSize._x), region._w, region._h, screenSize._x};
+  BlitTarget target {_pixels.data(), _windowSize._x, _windowSize._y, _windowSize._x};
+  blitScaled(source, target, position._x + (region._x * pixelSize), position._y + (region._y * pixelSize), pixelSize);
+}
+
+int SoftwareRenderer::saveWindow(const std::string& filename) const
+{
+  BmpImage::EncodeOptions options {BmpImage::ENCODE_BGR24, false};
+  return BmpImage::save(filename, _pixels.data(), _windowSize._x, _windowSize._y, options);
+}
+
+std::unique_ptr<SoftwareRenderer> softwareRenderer {nullptr};
 
 // A sprite represents a color image that can be drawn on a virtual screen. Pixels on the sprite
 // are positioned on a coordinate space mapped as shown below.
@@ -431,41 +553,59 @@ std::unique_ptr<Renderer> renderer {nullptr};
 //          |
 //   origin o----> col
 //
+// Sprites do not own their pixels; they view a region of a larger surface, such as an atlas
+// page, whose rows are stride pixels apart. The surface must outlive the sprite.
+//
+// Sprites are drawn opaque unless given another blit mode; sprites decoded from bitmaps without
+// an alpha channel have zero alpha, so only those with one should be alpha blended.
 class Sprite
 {
 public:
   Sprite();
-  Sprite(std::vector<Color4> pixels, int width, int height);
+  Sprite(const Color4* pixels, int width, int height, int stride);
   ~Sprite() = default;
   Sprite(const Sprite&) = default;
   Sprite(Sprite&&) = default;
   Sprite& operator=(const Sprite&) = default;
   Sprite& operator=(Sprite&&) = default;
-  void setPixel(int row, int col, const Color4& color);
-  const std::vector<Color4>& getPixels() const {return _pixels;}
+  void setBlitMode(BlitMode mode, Color4 colorKey = Color4{});
+  const Color4* getRow(int row) const {return _pixels + (row * _stride);}
   int getWidth() const {return _width;}
   int getHeight() const {return _height;}
+  int getStride() const {return _stride;}
+  BlitMode getBlitMode() const {return _blitMode;}
+  Color4 getColorKey() const {return _colorKey;}
 private:
-  std::vector<Color4> _pixels;
+  const Color4* _pixels;
   int _width;
   int _height;
+  int _stride;
+  BlitMode _blitMode;
+  Color4 _colorKey;
 };
 
 Sprite::Sprite() :
-  _pixels{},
+  _pixels{nullptr},
   _width{0},
-  _height{0}
+  _height{0},
+  _stride{0},
+  _blitMode{BLIT_OPAQUE},
+  _colorKey{}
 {}
 
-Sprite::Sprite(std::vector<Color4> pixels, int width, int height) : 
+Sprite::Sprite(const Color4* pixels, int width, int height, int stride) :
+  _pixels{pixels},
   _width{width},
   _height{height},
-  _pixels{pixels}
+  _stride{stride},
+  _blitMode{BLIT_OPAQUE},
+  _colorKey{}
 {}
 
-void Sprite::setPixel(int row, int col, const Color4& color)
+void Sprite::setBlitMode(BlitMode mode, Color4 colorKey)
 {
-  _pixels[col + (row * _width)] = color;
+  _blitMode = mode;
+  _colorKey = colorKey;
 }
 
 // A virtual screen with fixed resolution independent of display resolution and window size. The
@@ -483,8 +623,20 @@ void Sprite::setPixel(int row, int col, const Color4& color)
 //
 // note: virtual pixel sizes are limited to integer mulitiples of real pixels, i.e. integers.
 //
+// The colors of the pixels are kept in a plane of their own, so clears are vector fills and
+// sprites are blitted straight onto the plane.
+//
+// The screen is retained: the renderer keeps the presented pixels in a texture, and the areas
+// drawn to since the last render are tracked as a few dirty rects so that render uploads only
+// those. A scene which does not change need not be redrawn, and then costs a single quad.
 class Screen
 {
+public:
+  struct FrameStats
+  {
+    int _numDirtyRects;
+    int _numDirtyPixels;   // pixels uploaded; rects may overlap after a forced merge.
+  };
 public:
   Screen(Vector2i windowSize);
   ~Screen() = default;
@@ -493,70 +645,102 @@ public:
   void drawSprite(int x, int y, const Sprite& sprite);
   void rescalePixels(Vector2i windowSize);
   void render();
+  const FrameStats& getFrameStats() const {return _frameStats;}  // of the last render.
 private:
-  // 12 byte pixels designed to work with glInterleavedArrays format GL_C4UB_V2F.
-  struct Pixel
-  {
-    Color4 _color;
-    float _x;
-    float _y;
-  };
+  void addDamage(iRect area);
+  static iRect unite(const iRect& a, const iRect& b);
+  static int getArea(const iRect& rect) {return rect._w * rect._h;}
 private:
   static constexpr int screenWidth = 800; // in virtual pixels.
   static constexpr int screenHeight = 600;
   static constexpr int pixelCount = screenWidth * screenHeight;
+  static constexpr int maxDirtyRects = 8;
+  static constexpr int mergeSlack = 32 * 32; // in pixels; uploading these few more is cheaper than another upload.
 private:
   Vector2i _position;
-  std::array<Pixel, pixelCount> _pixels; // flattened 2D array accessed (col + (row * width))
+  std::array<Color4, pixelCount> _colors; // flattened 2D array accessed (col + (row * width))
+  std::vector<iRect> _dirtyRects;
+  FrameStats _frameStats;
   int _pixelSize;
 };
 
-Screen::Screen(Vector2i windowSize)
+// the texture starts undefined, so the whole screen is dirty.
+Screen::Screen(Vector2i windowSize) :
+  _colors{},
+  _dirtyRects{iRect{0, 0, screenWidth, screenHeight}},
+  _frameStats{0, 0}
 {
   rescalePixels(windowSize);
 }
 
 void Screen::clear(const Color4& color)
 {
-  for(auto& pixel : _pixels)
-    pixel._color = color;
+  fillColors(_colors.data(), _colors.size(), color);
+  _dirtyRects.assign(1, iRect{0, 0, screenWidth, screenHeight});
 }
 
 void Screen::drawPixel(int row, int col, const Color4& color)
 {
   assert(0 <= row && row < screenHeight);
   assert(0 <= col && col < screenWidth);
-  _pixels[col + (row * screenWidth)]._color = color;
+  _colors[col + (row * screenWidth)] = color;
+  addDamage(iRect{col, row, 1, 1});
 }
 
+// sprites may hang off any edge of the screen.
 void Screen::drawSprite(int x, int y, const Sprite& sprite)
 {
-  assert(x >= 0 && y >= 0);
-
-  const std::vector<Color4>& spritePixels {sprite.getPixels()};
-  int spriteWidth {sprite.getWidth()};
-  int spriteHeight {sprite.getHeight()};
-  
-  int spritePixelNum {0};
-  for(int spriteRow = 0; spriteRow < spriteHeight; ++spriteRow){
-    // if next row is above the screen.
-    if(y + spriteRow >= screenHeight)
-      break;
-
-    // index of 1st screen pixel in next row being drawn.
-    int screenRowIndex {x + ((y + spriteRow) * screenWidth)};   
-
-    for(int spriteCol = 0; spriteCol < spriteWidth; ++spriteCol){
-      // if the right side of the sprite falls outside the screen.
-      if(x + spriteCol >= screenWidth)
-        break;
+  BlitSource source {sprite.getRow(0), sprite.getWidth(), sprite.getHeight(), sprite.getStride()};
+  BlitTarget target {_colors.data(), screenWidth, screenHeight, screenWidth};
+  BlitRect area {blit(source, target, x, y, sprite.getBlitMode(), sprite.getColorKey())};
+  if(area._width_px > 0)
+    addDamage(iRect{area._x, area._y, area._width_px, area._height_px});
+}
 
-      _pixels[screenRowIndex + spriteCol]._color = spritePixels[spritePixelNum];  
-      ++spritePixelNum;
+// merges the area into every dirty rect which is cheaper to upload together with it than apart,
+// which may bring the merged rect over others, then merges the pair of rects which wastes the
+// fewest pixels until there are few enough rects.
+void Screen::addDamage(iRect area)
+{
+  for(size_t i = 0; i < _dirtyRects.size();){
+    iRect merged {unite(_dirtyRects[i], area)};
+    if(getArea(merged) <= getArea(_dirtyRects[i]) + getArea(area) + mergeSlack){
+      area = merged;
+      _dirtyRects.erase(_dirtyRects.begin() + i);
+      i = 0;
+    }
+    else
+      ++i;
+  }
+  _dirtyRects.push_back(area);
+
+  while(_dirtyRects.size() > maxDirtyRects){
+    size_t bestI {0}, bestJ {1};
+    int bestWaste {INT32_MAX};
+    for(size_t i = 0; i < _dirtyRects.size(); ++i){
+      for(size_t j = i + 1; j < _dirtyRects.size(); ++j){
+        int waste {getArea(unite(_dirtyRects[i], _dirtyRects[j])) - getArea(_dirtyRects[i]) - getArea(_dirtyRects[j])};
+        if(waste < bestWaste){
+          bestWaste = waste;
+          bestI = i;
+          bestJ = j;
+        }
+      }
     }
+    _dirtyRects[bestI] = unite(_dirtyRects[bestI], _dirtyRects[bestJ]);
+    _dirtyRects.erase(_dirtyRects.begin() + bestJ);
   }
 }
 
+iRect Screen::unite(const iRect& a, const iRect& b)
+{
+  int x0 {std::min(a._x, b._x)};
+  int y0 {std::min(a._y, b._y)};
+  int x1 {std::max(a._x + a._w, b._x + b._w)};
+  int y1 {std::max(a._y + a._h, b._y + b._h)};
+  return iRect{x0, y0, x1 - x0, y1 - y0};
+}
+
 void Screen::rescalePixels(Vector2i windowSize)
 {
   int pixelWidth = windowSize._x / screenWidth; 
@@ -564,23 +748,32 @@ void Screen::rescalePixels(Vector2i windowSize)
   _pixelSize = std::min(pixelWidth, pixelHeight);
   if(_pixelSize == 0)
     _pixelSize = 1;
-  int pixelCenterOffset = _pixelSize / 2;
   _position._x = std::clamp((windowSize._x - (_pixelSize * screenWidth)) / 2, 0, windowSize._x);
   _position._y = std::clamp((windowSize._y - (_pixelSize * screenHeight)) / 2, 0, windowSize._y);
-  for(int col = 0; col < screenWidth; ++col){
-    for(int row = 0; row < screenHeight; ++row){
-      int index = col + (row * screenWidth);
-      Pixel& pixel = _pixels[index];
-      pixel._x = _position._x + (col * _pixelSize) + pixelCenterOffset;
-      pixel._y = _position._y + (row * _pixelSize) + pixelCenterOffset;
-    }
-  }
+
+  // a software renderer loses its window's pixels when the window is resized.
+  _dirtyRects.assign(1, iRect{0, 0, screenWidth, screenHeight});
 }
 
 void Screen::render()
 {
   //auto now0 = std::chrono::high_resolution_clock::now();
-  pxr::renderer->drawPixelArray(0, pixelCount, static_cast<void*>(_pixels.data()), _pixelSize);
+  Vector2i screenSize {screenWidth, screenHeight};
+  _frameStats = FrameStats{static_cast<int>(_dirtyRects.size()), 0};
+  for(const iRect& rect : _dirtyRects){
+#ifndef EXAMPLE_NO_SDL
+    if(pxr::renderer != nullptr)
+      pxr::renderer->updateScreenTexture(screenSize, _colors.data(), rect);
+#endif
+    if(pxr::softwareRenderer != nullptr)
+      pxr::softwareRenderer->drawScreenRegion(_colors.data(), screenSize, rect, _position, _pixelSize);
+    _frameStats._numDirtyPixels += getArea(rect);
+  }
+  _dirtyRects.clear();
+#ifndef EXAMPLE_NO_SDL
+  if(pxr::renderer != nullptr)
+    pxr::renderer->drawScreenTexture(iRect{_position._x, _position._y, screenWidth * _pixelSize, screenHeight * _pixelSize});
+#endif
   //auto now1 = std::chrono::high_resolution_clock::now();
   //std::cout << "Screen::render execution time (us): "
   //          << std::chrono::duration_cast<std::chrono::microseconds>(now1 - now0).count()
@@ -595,65 +788,116 @@ public:
   Example();
   ~Example() = default;
   void draw();
+  bool isLoading() const {return _numPendingSprites != 0;}
 private:
   static constexpr Vector2i worldDimensions {50, 50}; // [x:width(num cols), y:height(num rows)]
+  static constexpr const char* atlasCacheFilename {"sprites.atlas"};
+  struct PendingSprite
+  {
+    std::string _filename;
+    std::future<BmpAsyncLoader::Result> _future;
+  };
 private:
   void generateSprites();
+  void collectSprites();
+  void buildAtlas();
 private:
+  BmpAsyncLoader _loader;
+  std::vector<PendingSprite> _pendingSprites;
+  std::vector<BmpAsyncLoader::Result> _loadedSprites;
+  std::vector<BlitMode> _blitModes;
+  int _numPendingSprites;
+  bool _isSceneStale;
+  BmpAtlas _atlas;
   std::vector<Sprite> _sprites;
 };
 
-Example::Example()
+Example::Example() :
+  _numPendingSprites{0},
+  _isSceneStale{true}
 {
   generateSprites();
 }
 
+// sprites are loaded in the background and are blank until every file has been decoded and
+// packed into the atlas.
 void Example::generateSprites()
 {
-  {
-  BmpImage image;
-  image.load("1bpp_indexed.bmp");
-  _sprites.push_back(Sprite{image.getPixels(), image.getWidth(), image.getHeight()});
-  }
-  {
-  BmpImage image;
-  image.load("4bpp_indexed.bmp");
-  _sprites.push_back(Sprite{image.getPixels(), image.getWidth(), image.getHeight()});
-  }
-  {
-  BmpImage image;
-  image.load("8bpp_indexed.bmp");
-  _sprites.push_back(Sprite{image.getPixels(), image.getWidth(), image.getHeight()});
-  }
-  {
-  BmpImage image;
-  image.load("16bpp_R5G6B5_bear.bmp");
-  _sprites.push_back(Sprite{image.getPixels(), image.getWidth(), image.getHeight()});
-  }
-  {
-  BmpImage image;
-  image.load("16bpp_X1R5G5B5_moose.bmp");
-  _sprites.push_back(Sprite{image.getPixels(), image.getWidth(), image.getHeight()});
-  }
-  {
-  BmpImage image;
-  image.load("24bpp_R8G8B8_cat.bmp");
-  _sprites.push_back(Sprite{image.getPixels(), image.getWidth(), image.getHeight()});
+  std::vector<std::string> filenames {
+    "1bpp_indexed.bmp",
+    "4bpp_indexed.bmp",
+    "8bpp_indexed.bmp",
+    "16bpp_R5G6B5_bear.bmp",
+    "16bpp_X1R5G5B5_moose.bmp",
+    "24bpp_R8G8B8_cat.bmp",
+    "32bpp_A8R8G8B8_seal.bmp",
+    "32bpp_X8R8G8B8_lhama.bmp"
+  };
+
+  for(std::string& filename : filenames){
+    _blitModes.push_back(filename.find("A8R8G8B8") != std::string::npos ? BLIT_ALPHA : BLIT_OPAQUE);
+    _sprites.push_back(Sprite{});
+    _loadedSprites.push_back(BmpAsyncLoader::Result{BmpBatchLoader::ERROR_NONE, 0, 0, {}});
+    _pendingSprites.push_back(PendingSprite{filename, _loader.load(filename)});
   }
-  {
-  BmpImage image;
-  image.load("32bpp_A8R8G8B8_seal.bmp");
-  _sprites.push_back(Sprite{image.getPixels(), image.getWidth(), image.getHeight()});
+  _numPendingSprites = static_cast<int>(_pendingSprites.size());
+}
+
+void Example::collectSprites()
+{
+  if(_numPendingSprites == 0)
+    return;
+
+  for(size_t i = 0; i < _pendingSprites.size(); ++i){
+    std::future<BmpAsyncLoader::Result>& future {_pendingSprites[i]._future};
+    if(!future.valid() || future.wait_for(std::chrono::seconds{0}) != std::future_status::ready)
+      continue;
+
+    _loadedSprites[i] = future.get();
+    if(_loadedSprites[i]._error != BmpBatchLoader::ERROR_NONE)
+      pxr::log->log(Log::ERROR, logstr::fail_load_bitmap, _pendingSprites[i]._filename);
+    --_numPendingSprites;
   }
-  {
-  BmpImage image;
-  image.load("32bpp_X8R8G8B8_lhama.bmp");
-  _sprites.push_back(Sprite{image.getPixels(), image.getWidth(), image.getHeight()});
+
+  if(_numPendingSprites == 0)
+    buildAtlas();
+}
+
+// packs every loaded sprite into the atlas and frees the per sprite pixels; a sprite which
+// failed to load has no size and so takes no space.
+void Example::buildAtlas()
+{
+  std::vector<BmpAtlas::Image> images {};
+  for(const BmpAsyncLoader::Result& result : _loadedSprites)
+    images.push_back(BmpAtlas::Image{result._pixels.data(), result._width_px, result._height_px});
+
+  if(_atlas.build(images, atlasCacheFilename) != 0)
+    pxr::log->log(Log::ERROR, logstr::fail_build_atlas);
+  else{
+    for(size_t i = 0; i < _sprites.size(); ++i){
+      const BmpAtlas::Rect& rect {_atlas.getRect(static_cast<int>(i))};
+      if(rect._width_px == 0 || rect._height_px == 0)
+        continue;
+      const BmpAtlas::Page& page {_atlas.getPage(rect._page)};
+      const Color4* pixels {page._pixels.data() + rect._x + (rect._y * page._width_px)};
+      _sprites[i] = Sprite{pixels, rect._width_px, rect._height_px, page._width_px};
+      _sprites[i].setBlitMode(_blitModes[i]);
+    }
   }
+
+  _loadedSprites.clear();
+  _isSceneStale = true;
 }
 
+// the screen retains what was drawn, so the scene is only redrawn when it has changed, which
+// here is only once the sprites have loaded.
 void Example::draw()
 {
+  collectSprites();
+  if(!_isSceneStale)
+    return;
+
+  _isSceneStale = false;
   pxr::screen->clear(colors::gainsboro);
   pxr::screen->drawSprite(10, 10, _sprites[0]);
   pxr::screen->drawSprite(50, 10, _sprites[1]);
@@ -712,12 +956,17 @@ public:
   App(const App&&) = delete;
   App& operator=(const App&) = delete;
   App& operator=(App&&) = delete;
+#ifndef EXAMPLE_NO_SDL
   void initialize();
-  void shutdown();
   void run();
+#endif
+  void shutdown();
+  int runHeadless(int numFrames, const std::string& filename, Vector2i windowSize = Vector2i{windowWidth_px, windowHeight_px});
 private:
+#ifndef EXAMPLE_NO_SDL
   void loop();
   void onTick(float dt);
+#endif
 private:
   static constexpr const char* name = "bmp loading test";
   static constexpr int appVersionMajor = 0;
@@ -775,6 +1024,7 @@ App::~App()
 {
 }
 
+#ifndef EXAMPLE_NO_SDL
 void App::initialize()
 {
   pxr::log = std::make_unique<Log>();
@@ -801,19 +1051,64 @@ void App::initialize()
     pxr::screen->rescalePixels(windowSize);
 }
 
+void App::run()
+{
+  while(!_isDone)
+    loop();
+}
+#endif
+
 void App::shutdown()
 {
   pxr::log.reset(nullptr);
   pxr::input.reset(nullptr);
+#ifndef EXAMPLE_NO_SDL
   pxr::renderer.reset(nullptr);
+#endif
+  pxr::softwareRenderer.reset(nullptr);
+  pxr::screen.reset(nullptr);
 }
 
-void App::run()
+// runs without a display: frames are presented by the software renderer and the last is saved
+// as a bitmap, so the whole frame pipeline can be tested and timed on headless machines. Frames
+// are counted from when the sprites have loaded, so every run presents the same frames.
+int App::runHeadless(int numFrames, const std::string& filename, Vector2i windowSize)
 {
-  while(!_isDone)
-    loop();
+  pxr::log = std::make_unique<Log>();
+  pxr::screen = std::make_unique<Screen>(windowSize);
+  pxr::softwareRenderer = std::make_unique<SoftwareRenderer>(windowSize);
+  pxr::softwareRenderer->clearWindow(colors::jet);
+
+  while(_example.isLoading()){
+    _example.draw();
+    std::this_thread::sleep_for(std::chrono::milliseconds{1});
+  }
+
+  Duration_t totalTime {0};
+  int64_t totalDirtyPixels {0};
+  for(int frame = 0; frame < numFrames; ++frame){
+    auto now0 = Clock_t::now();
+    _example.draw();
+    pxr::screen->render();
+    totalTime += Clock_t::now() - now0;
+    totalDirtyPixels += pxr::screen->getFrameStats()._numDirtyPixels;
+  }
+
+  if(numFrames > 0){
+    std::cout << "frames: " << numFrames
+              << " mean frame time (us): " << (std::chrono::duration<double>(totalTime).count() * 1e6) / numFrames
+              << " mean dirty pixels: " << totalDirtyPixels / numFrames
+              << std::endl;
+  }
+
+  if(pxr::softwareRenderer->saveWindow(filename) != 0){
+    pxr::log->log(Log::ERROR, logstr::fail_save_frame, filename);
+    return -1;
+  }
+  return 0;
 }
 
+#ifndef EXAMPLE_NO_SDL
 void App::loop()
 {
   auto now0 = Clock_t::now();
@@ -864,6 +1159,7 @@ void App::onTick(float dt)
   pxr::screen->render();
   pxr::renderer->show();
 }
+#endif
 
 std::unique_ptr<App> app {nullptr};
 
@@ -873,12 +1169,43 @@ std::unique_ptr<App> app {nullptr};
 //  MAIN                                                                                          
 //------------------------------------------------------------------------------------------------
 
-int main()
+// usage: example [--headless FRAMES FILENAME [WIDTH HEIGHT]]
+//
+// --headless presents FRAMES frames without a display and saves the last as a bitmap; it is the
+// only mode of a build without SDL.
+int main(int argc, char** argv)
 {
   pxr::app = std::make_unique<pxr::App>();
-  pxr::app->initialize();
-  pxr::app->run();
+
+#ifndef EXAMPLE_NO_SDL
+  bool isHeadless {argc > 1};
+#else
+  bool isHeadless {true};
+#endif
+
+  int result {EXIT_SUCCESS};
+  if(isHeadless){
+    if(argc < 2 || std::string{argv[1]} != "--headless" || (argc != 4 && argc != 6)){
+      std::cerr << "usage: " << argv[0] << " [--headless FRAMES FILENAME [WIDTH HEIGHT]]" << std::endl;
+      return EXIT_FAILURE;
+    }
+    int numFrames {std::max(std::atoi(argv[2]), 0)};
+    if(argc == 6){
+      pxr::Vector2i windowSize {std::max(std::atoi(argv[4]), 1), std::max(std::atoi(argv[5]), 1)};
+      result = pxr::app->runHeadless(numFrames, argv[3], windowSize) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    else
+      result = pxr::app->runHeadless(numFrames, argv[3]) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+#ifndef EXAMPLE_NO_SDL
+  else{
+    pxr::app->initialize();
+    pxr::app->run();
+  }
+#endif
+
   pxr::app->shutdown();
   pxr::app.reset(nullptr);
+  return result;
 }
 
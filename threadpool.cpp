@@ -0,0 +1,141 @@
+//----------------------------------------------------------------------------------------------//
+// FILE: threadpool.cpp                                                                         //
+// AUTHOR: Ian Murfin - github.com/ianmurfinxyz                                                 //
+//----------------------------------------------------------------------------------------------//
+
+#include <algorithm>
+#include "threadpool.h"
+
+namespace
+{
+
+// the index of the pool worker running on this thread, or -1 for threads outside the pool.
+thread_local int workerIndex {-1};
+thread_local const ThreadPool* workerPool {nullptr};
+
+} // namespace
+
+ThreadPool::ThreadPool(int numThreads) :
+  _numQueued{0},
+  _numPending{0},
+  _nextQueue{0},
+  _isStopping{false}
+{
+  if(numThreads <= 0)
+    numThreads = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+
+  for(int i = 0; i < numThreads; ++i)
+    _queues.push_back(std::make_unique<Queue>());
+
+  for(int i = 0; i < numThreads; ++i)
+    _threads.emplace_back(&ThreadPool::run, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+  wait();
+  {
+    std::lock_guard<std::mutex> lock {_mutex};
+    _isStopping = true;
+  }
+  _wake.notify_all();
+  for(std::thread& thread : _threads)
+    thread.join();
+}
+
+void ThreadPool::submit(Task task)
+{
+  int queueNo {(workerPool == this) ? workerIndex : static_cast<int>(_nextQueue++ % _queues.size())};
+
+  ++_numPending;
+  {
+    std::lock_guard<std::mutex> lock {_queues[queueNo]->_mutex};
+    _queues[queueNo]->_tasks.push_back(std::move(task));
+  }
+
+  // the count is raised under the pool mutex so a worker cannot miss the wake up between
+  // checking for work and going to sleep.
+  {
+    std::lock_guard<std::mutex> lock {_mutex};
+    ++_numQueued;
+  }
+  _wake.notify_one();
+}
+
+void ThreadPool::wait()
+{
+  wait(_numPending);
+}
+
+void ThreadPool::wait(const std::atomic<int>& count)
+{
+  int self {(workerPool == this) ? workerIndex : -1};
+  Task task {};
+  while(count > 0){
+    if(takeTask(self, task)){
+      task();
+      finishTask();
+      continue;
+    }
+    std::unique_lock<std::mutex> lock {_mutex};
+    _idle.wait(lock, [this, &count](){return count == 0 || _numQueued > 0;});
+  }
+}
+
+void ThreadPool::run(int self)
+{
+  workerIndex = self;
+  workerPool = this;
+
+  Task task {};
+  while(true){
+    if(takeTask(self, task)){
+      task();
+      finishTask();
+      continue;
+    }
+    std::unique_lock<std::mutex> lock {_mutex};
+    _wake.wait(lock, [this](){return _isStopping || _numQueued > 0;});
+    if(_isStopping && _numQueued == 0)
+      return;
+  }
+}
+
+bool ThreadPool::takeTask(int self, Task& task)
+{
+  int numQueues {static_cast<int>(_queues.size())};
+
+  // own queue first, newest task first, as its data is most likely still in cache.
+  if(self >= 0){
+    Queue& own {*_queues[self]};
+    std::lock_guard<std::mutex> lock {own._mutex};
+    if(!own._tasks.empty()){
+      task = std::move(own._tasks.back());
+      own._tasks.pop_back();
+      --_numQueued;
+      return true;
+    }
+  }
+
+  // then steal the oldest task of another queue, starting from the next queue along.
+  for(int i = 1; i <= numQueues; ++i){
+    Queue& victim {*_queues[(std::max(self, 0) + i) % numQueues]};
+    std::lock_guard<std::mutex> lock {victim._mutex};
+    if(!victim._tasks.empty()){
+      task = std::move(victim._tasks.front());
+      victim._tasks.pop_front();
+      --_numQueued;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// waiters are woken after every task, as any task may be the last of a group being waited on.
+void ThreadPool::finishTask()
+{
+  --_numPending;
+  std::lock_guard<std::mutex> lock {_mutex};
+  _idle.notify_all();
+}
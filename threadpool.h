@@ -0,0 +1,70 @@
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+
+//----------------------------------------------------------------------------------------------//
+// FILE: threadpool.h                                                                           //
+// AUTHOR: Ian Murfin - github.com/ianmurfinxyz                                                 //
+//----------------------------------------------------------------------------------------------//
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A pool of worker threads with a task queue per worker. Workers take tasks from the back of
+// their own queue and, when it is empty, steal from the front of the others, so a worker which
+// finishes early takes on the remaining work of busy workers.
+class ThreadPool
+{
+public:
+  using Task = std::function<void()>;
+
+public:
+  // numThreads of 0 uses one thread per hardware thread.
+  explicit ThreadPool(int numThreads = 0);
+  ~ThreadPool();
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // tasks submitted from a worker go to its own queue, others are spread across all queues.
+  void submit(Task task);
+
+  // blocks until every submitted task has completed; the calling thread runs tasks meanwhile.
+  void wait();
+
+  // blocks until count falls to zero, running tasks meanwhile; for waiting on a group of tasks
+  // which each lower count as they finish, while the pool may hold other work. Unlike wait it
+  // may be called from a task of the pool.
+  void wait(const std::atomic<int>& count);
+
+  int getNumThreads() const {return static_cast<int>(_threads.size());}
+
+private:
+  struct Queue
+  {
+    std::mutex _mutex;
+    std::deque<Task> _tasks;
+  };
+
+private:
+  void run(int self);
+  bool takeTask(int self, Task& task);
+  void finishTask();
+
+private:
+  std::vector<std::unique_ptr<Queue>> _queues;
+  std::vector<std::thread> _threads;
+  std::mutex _mutex;
+  std::condition_variable _wake;
+  std::condition_variable _idle;
+  std::atomic<int> _numQueued;
+  std::atomic<int> _numPending;
+  std::atomic<unsigned> _nextQueue;
+  bool _isStopping;
+};
+
+#endif